@@ -0,0 +1,60 @@
+# Copyright (c) 2021 Triad National Security, LLC, as operator of Los Alamos
+# National Laboratory with the U.S. Department of Energy/National Nuclear
+# Security Administration. All Rights Reserved.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# with the Software without restriction, including without limitation the
+# rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+# sell copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# 1. Redistributions of source code must retain the above copyright notice,
+#    this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. Neither the name of TRIAD, Los Alamos National Laboratory, LANL, the
+#    U.S. Government, nor the names of its contributors may be used to endorse
+#    or promote products derived from this software without specific prior
+#    written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+# IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+# EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+# INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+# Find liburing and set up an imported target for it
+#
+# inputs:
+#   - URING_INCLUDE_DIR: hint for finding liburing.h
+#   - URING_LIBRARY_DIR: hint for finding the uring library
+#
+# output:
+#   - "uring" library target
+#   - URING_FOUND  (set if found)
+#
+include(FindPackageHandleStandardArgs)
+
+find_path(URING_INCLUDE liburing.h HINTS ${URING_INCLUDE_DIR})
+find_library(URING_LIBRARY uring HINTS ${URING_LIBRARY_DIR})
+
+find_package_handle_standard_args(URING DEFAULT_MSG URING_INCLUDE
+        URING_LIBRARY)
+mark_as_advanced(URING_INCLUDE URING_LIBRARY)
+
+if (URING_FOUND)
+    if (NOT TARGET uring)
+        add_library(uring UNKNOWN IMPORTED)
+        set_target_properties(uring PROPERTIES
+                INTERFACE_INCLUDE_DIRECTORIES "${URING_INCLUDE}")
+        set_property(TARGET uring APPEND PROPERTY
+                IMPORTED_LOCATION "${URING_LIBRARY}")
+    endif ()
+endif ()
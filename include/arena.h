@@ -0,0 +1,23 @@
+#ifndef C2_LIBZDB_ARENA_H
+#define C2_LIBZDB_ARENA_H
+
+#include <stddef.h>
+
+typedef struct chunk chunk_t;
+
+/*
+ * A bump allocator. Allocations are never freed one by one; they are all
+ * released at once by c2arena_reset() or c2arena_fin().
+ */
+typedef struct c2arena {
+	chunk_t *head; /* chunk allocations are carved from */
+	size_t chunk_size;
+} c2arena_t;
+
+void c2arena_init(c2arena_t *arena, size_t chunk_size);
+void *c2arena_alloc(c2arena_t *arena, size_t size);
+char *c2arena_strdup(c2arena_t *arena, const char *str);
+void c2arena_reset(c2arena_t *arena);
+void c2arena_fin(c2arena_t *arena);
+
+#endif
@@ -0,0 +1,543 @@
+#ifndef C2_LIBZDB_LIBZDB_H
+#define C2_LIBZDB_LIBZDB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Default number of indirect block reads kept in flight per tree level */
+#define LIBZDB_DEFAULT_PREFETCH 32
+
+/* Most copies of a block, i.e. DVAs of a block pointer */
+#define LIBZDB_MAX_DVAS 3
+
+/* libzdb_block_t flags */
+/*
+ * The data of the block is embedded in its block pointer: offset is the
+ * position of its psize bytes of compressed data in the map's embedded
+ * payloads
+ */
+#define LIBZDB_BLOCK_EMBEDDED 0x1
+/*
+ * The block is one member of a gang block, whose data is split across
+ * several smaller blocks located by a gang header. Every member has the
+ * file offset, sizes and compression of the whole block, its own copies,
+ * and holds gang_size bytes of the block's physical data from gang_offset.
+ */
+#define LIBZDB_BLOCK_GANG 0x2
+/*
+ * checksum and cksum hold the checksum of the physical data of the block,
+ * or of the member for LIBZDB_BLOCK_GANG. Not set for holes, embedded
+ * blocks and blocks whose checksum is off.
+ */
+#define LIBZDB_BLOCK_CHECKSUM 0x4
+/*
+ * The block was written by a host of the other byte order: as ZFS does,
+ * its data is checked with the byteswapping variant of its checksum
+ */
+#define LIBZDB_BLOCK_BYTESWAP 0x8
+
+/*
+ * Information retrieved from a L0 block pointer of a given plain zfs file.
+ * The extents of a block refer to it for the compression and checksum of
+ * their data, which are thus kept once per block.
+ */
+typedef struct libzdb_block {
+	/* Logical offset of the file */
+	uint64_t file_offset;
+	uint64_t offset; /* Offset of the first copy on its vdev */
+	uint32_t vdev;	 /* Top-level vdev of the first copy */
+	/*
+	 * Logical amount of file data represented by the block. Logical file
+	 * size may still be larger than true file size (size reported by `ls`)
+	 * due to potential data padding within a block or an ashift
+	 */
+	uint32_t file_data;
+	/*
+	 * Physical amount of file data stored on disk. Less amount of data may
+	 * be written to disk due to data compression or holes in a file
+	 */
+	uint32_t physical_file_data;
+	/*
+	 * Amount of file data to read from the block, 0 for holes: the true
+	 * file data it holds, or all of its physical data if it is compressed
+	 */
+	uint32_t actual_size;
+	/* Part of the physical data held by a LIBZDB_BLOCK_GANG member */
+	uint32_t gang_offset;
+	uint32_t gang_size;
+	uint8_t compress; /* ZIO_COMPRESS_* of the block */
+	/* Set for LIBZDB_BLOCK_CHECKSUM blocks only */
+	uint8_t checksum; /* ZIO_CHECKSUM_* */
+	uint8_t flags;	  /* LIBZDB_BLOCK_* */
+	/*
+	 * Number of copies of the block (copies=2 or 3, or ditto blocks), 0
+	 * for holes. Only the first is kept here; the extents of the others
+	 * carry LIBZDB_EXTENT_COPY.
+	 */
+	uint8_t ndvas;
+	uint64_t cksum[4];
+} libzdb_block_t;
+
+/* libzdb_extent_t flags */
+#define LIBZDB_EXTENT_RAIDZ 0x1 /* a data column of a raidz block */
+/*
+ * Another copy of file data also held by the extents without this flag,
+ * e.g. on a mirror child other than the first or in a DVA other than the
+ * first. A reader that does not balance its reads across copies skips
+ * these extents.
+ */
+#define LIBZDB_EXTENT_COPY 0x2
+/*
+ * Part of the compressed data of its block. Its file_offset is that of the
+ * block plus the position of the extent within the physical_file_data
+ * bytes of compressed data, which decompress to the file_data bytes of the
+ * block.
+ */
+#define LIBZDB_EXTENT_COMPRESSED 0x4
+/*
+ * Data embedded in the block pointer rather than stored on a device, and
+ * thus always compressed: dev_offset is the position of the data in the
+ * embedded payloads of the map, and dev is meaningless.
+ */
+#define LIBZDB_EXTENT_EMBEDDED 0x8
+/*
+ * Part of the checksummed physical data of its block, read whole by the
+ * extents of the block: the physical_file_data bytes from the file_offset
+ * of the block, or the gang_size bytes from file_offset + gang_offset of a
+ * LIBZDB_BLOCK_GANG member. Extents joined by libzdb_map_coalesce() lose
+ * this flag.
+ */
+#define LIBZDB_EXTENT_CHECKSUM 0x10
+
+/* A run of file data stored contiguously on a single device */
+typedef struct libzdb_extent {
+	uint64_t file_offset; /* Logical offset of the file */
+	/* Byte offset on the device, including the front vdev labels */
+	uint64_t dev_offset;
+	uint64_t length;
+	uint32_t dev;	/* Index into the device table of the map */
+	uint32_t flags; /* LIBZDB_EXTENT_* */
+	uint32_t block; /* Index of the L0 block holding it in the map */
+	uint16_t child; /* Child of the top-level vdev, i.e. the device */
+	uint16_t col;	/* Raidz column, 0 for other vdev types */
+} libzdb_extent_t;
+
+/* How an I/O plan chooses among the copies of the same file data */
+typedef enum {
+	/* always the extents without LIBZDB_EXTENT_COPY */
+	LIBZDB_COPY_FIRST,
+	/* rotate through the copies every LIBZDB_COPY_ROTOR_SHIFT bytes */
+	LIBZDB_COPY_ROTOR,
+	/* the copy on the device with the fewest bytes planned so far */
+	LIBZDB_COPY_LEAST_LOADED,
+	/* like LIBZDB_COPY_LEAST_LOADED, weighed by observed latencies */
+	LIBZDB_COPY_LATENCY,
+} libzdb_copy_policy_t;
+
+/* log2 of the file bytes read from one copy in turn, as ZFS mirrors do */
+#define LIBZDB_COPY_ROTOR_SHIFT 21
+
+/* The disk locations of the data of one file */
+typedef struct libzdb_map {
+	uint64_t pool_guid;
+	char *dataset;
+	uint64_t object;
+	/* Znode generation, tells files that reused an object number apart */
+	uint64_t gen;
+	/* Highest birth txg of the file's top-level block pointers */
+	uint64_t txg;
+	uint64_t file_size;
+	/* Salt of the pool's salted checksums, e.g. skein */
+	uint8_t cksum_salt[32];
+	/*
+	 * Byte range of the file that was mapped, [range_start, range_end).
+	 * Blocks overlapping the range are included whole.
+	 */
+	uint64_t range_start;
+	uint64_t range_end;
+	/* Names of every device of the pool, indexed by extent dev */
+	char **devs;
+	/* Top-level vdev of every device, indexed like devs */
+	uint32_t *dev_vdevs;
+	/*
+	 * Hash of the states of the devices, which decide the copies listed:
+	 * the children of a mirror that are not healthy are left out
+	 */
+	uint64_t dev_health;
+	size_t ndevs;
+	/* L0 block pointers in file order, indexed by extent block */
+	libzdb_block_t *blocks;
+	size_t nblocks;
+	size_t blocks_cap;
+	/* Extents in file order */
+	libzdb_extent_t *extents;
+	size_t nextents;
+	size_t extents_cap;
+	/* Number of extents folded into others by libzdb_map_coalesce() */
+	size_t merged;
+	/* Payloads of LIBZDB_EXTENT_EMBEDDED extents, read without any I/O */
+	uint8_t *embedded;
+	size_t embedded_len;
+	size_t embedded_cap;
+	/* Copy selection of LIBZDB_FORMAT_PLAN output, set by the session */
+	libzdb_copy_policy_t policy;
+} libzdb_map_t;
+
+typedef enum {
+	/* human readable, one line per block and per extent */
+	LIBZDB_FORMAT_TEXT,
+	/*
+	 * Compact little-endian records:
+	 *
+	 *   header   char magic[8] = "C2ZDBMAP", u32 version, u32 ndevs,
+	 *            u64 pool_guid, u64 object, u64 txg, u64 file_size,
+	 *            u64 dev_health, u64 nblocks, u64 nextents,
+	 *            u64 embedded_len,
+	 *            u8 cksum_salt[32], u32 dataset_len,
+	 *            char dataset[dataset_len]
+	 *   devices  ndevs x { u32 vdev, u32 len, char name[len] }
+	 *   blocks   nblocks x { u64 file_offset, u64 offset, u32 vdev,
+	 *                        u32 file_data, u32 physical_file_data,
+	 *                        u32 actual_size, u32 gang_offset,
+	 *                        u32 gang_size, u8 compress, u8 checksum,
+	 *                        u8 flags, u8 ndvas, u64 cksum[4] }
+	 *   extents  nextents x { u32 dev, u32 flags, u64 dev_offset,
+	 *                         u64 length, u64 file_offset, u32 block,
+	 *                         u16 child, u16 col }
+	 *   embedded char payloads[embedded_len]
+	 *
+	 * The compression and checksum of a block are stored once, in its
+	 * block record, which its extents refer to by index. Only the first
+	 * copy of a block is recorded with it; the others are extents.
+	 */
+	LIBZDB_FORMAT_BINARY,
+	/* human readable I/O plan, as written by libzdb_plan_write() */
+	LIBZDB_FORMAT_PLAN,
+} libzdb_format_t;
+
+#define LIBZDB_MAP_MAGIC "C2ZDBMAP"
+#define LIBZDB_MAP_VERSION 8
+
+/*
+ * A libzdb session. Opening a session initializes the zfs userland kernel
+ * once. Pool topologies are loaded and datasets are owned on first use and
+ * kept until the session is closed, so mapping many files costs one pool
+ * import rather than one per file. Only one session may be open at a time
+ * within a process.
+ */
+typedef struct libzdb_session libzdb_session_t;
+
+/*
+ * Open a session. cachefile names the zpool cache used to import pools,
+ * whose vdev topology is then taken from the imported vdev tree; NULL
+ * selects the default zpool cache.
+ * Returns NULL on failure.
+ */
+libzdb_session_t *libzdb_open(const char *cachefile);
+
+/*
+ * Set whether maps are coalesced with libzdb_map_coalesce() before they are
+ * returned. Off by default.
+ */
+void libzdb_set_coalesce(libzdb_session_t *session, int coalesce);
+
+/*
+ * Set how many child indirect blocks are read ahead, asynchronously, while
+ * walking each level of a file's block tree. Zero walks the tree one
+ * blocking read at a time.
+ */
+void libzdb_set_prefetch(libzdb_session_t *session, uint32_t prefetch);
+
+/*
+ * Set how the I/O plans of maps written as LIBZDB_FORMAT_PLAN choose among
+ * copies of the same data. LIBZDB_COPY_LEAST_LOADED by default.
+ */
+void libzdb_set_copy_policy(
+    libzdb_session_t *session, libzdb_copy_policy_t policy);
+
+/*
+ * Keep the extent maps of whole files in the directory dir, or stop doing
+ * so if dir is NULL. Entries are keyed by pool GUID, objset, object number
+ * and znode generation, and are only reused while the highest birth txg of
+ * the file's top-level block pointers, the file size and the states of the
+ * pool's devices are unchanged, in which case the file is mapped without
+ * reading any indirect block. Entries outdated by writes are updated as
+ * with libzdb_remap(). Off by default.
+ */
+void libzdb_set_cache(libzdb_session_t *session, const char *dir);
+
+/*
+ * Map the file at path, relative to the root of dataset, to the disk
+ * locations holding its data. The path may go through any number of
+ * directories; resolved directory entries are cached by the session. On
+ * success *mapp is set to a new map that must be released with
+ * libzdb_map_free(); its device table belongs to the session and remains
+ * valid until the session is closed. Returns 0 on success or an errno value
+ * on failure.
+ */
+int libzdb_map_file(libzdb_session_t *session, const char *dataset,
+    const char *path, libzdb_map_t **mapp);
+
+/*
+ * Join extents that are contiguous both on their device and within the
+ * file, such as the consecutive blocks of a sequentially written file on a
+ * stripe or mirror vdev. The copies of a block are each joined to the same
+ * copy of the block before. Joined extents no longer span one block, so
+ * their checksums are dropped. Returns the number of extents removed.
+ */
+size_t libzdb_map_coalesce(libzdb_map_t *map);
+
+/*
+ * Like libzdb_map_file(), but only map the blocks overlapping the byte
+ * range [offset, offset + length) of the file; a length of 0 extends the
+ * range to the end of the file. Indirect blocks outside of the range are
+ * not read, so the cost depends on the size of the range rather than on
+ * the size of the file.
+ */
+int libzdb_map_range(libzdb_session_t *session, const char *dataset,
+    const char *path, uint64_t offset, uint64_t length, libzdb_map_t **mapp);
+
+/*
+ * Like libzdb_map_file(), but name the file by its object number within
+ * dataset. Returns EINVAL if the object is not a plain file.
+ */
+int libzdb_map_object(libzdb_session_t *session, const char *dataset,
+    uint64_t object, libzdb_map_t **mapp);
+
+/*
+ * Map the file of prev, a map of a whole file, again. Only the indirect
+ * blocks born after prev->txg are read: the extents of the blocks that
+ * changed since prev was made are spliced into those of prev, so the cost
+ * depends on the amount of change rather than on the size of the file. The
+ * file is mapped from scratch if its object number was reused or a device
+ * of the pool changed state since prev was made. Returns
+ * EINVAL if prev only maps a range of the file.
+ */
+int libzdb_remap(
+    libzdb_session_t *session, const libzdb_map_t *prev, libzdb_map_t **mapp);
+
+/*
+ * Advance *object to the next plain file object of dataset; start from 0.
+ * Returns 0 when one is found, ESRCH once there are no more, or another
+ * errno value on failure.
+ */
+int libzdb_next_file(
+    libzdb_session_t *session, const char *dataset, uint64_t *object);
+
+/* Write a map to out. Returns 0 on success or an errno value on failure. */
+int libzdb_map_write(
+    const libzdb_map_t *map, FILE *out, libzdb_format_t format);
+
+void libzdb_map_free(libzdb_map_t *map);
+
+/* A read of one extent within an I/O plan */
+typedef struct libzdb_plan_io {
+	uint64_t dev_offset; /* as in libzdb_extent_t */
+	uint64_t length;
+	uint64_t file_offset;
+	/* Position in a buffer holding the file from buf_start of the plan */
+	uint64_t buf_offset;
+} libzdb_plan_io_t;
+
+/* The reads of one device, in device offset order */
+typedef struct libzdb_plan_dev {
+	uint32_t dev; /* Index into the device table of the map */
+	libzdb_plan_io_t *ios;
+	size_t nios;
+	uint64_t bytes; /* Total length of the reads */
+} libzdb_plan_dev_t;
+
+/*
+ * A compressed block of an I/O plan. Its psize bytes of compressed data are
+ * read at buf_offset, where its lsize bytes are expected once decompressed.
+ */
+typedef struct libzdb_plan_zblock {
+	uint64_t file_offset;
+	uint64_t buf_offset;
+	uint32_t psize;
+	uint32_t lsize;
+	uint32_t compress; /* ZIO_COMPRESS_* */
+} libzdb_plan_zblock_t;
+
+/*
+ * A block of an I/O plan whose checksum can be verified once its size
+ * bytes of physical data are read at buf_offset
+ */
+typedef struct libzdb_plan_cblock {
+	uint64_t file_offset;
+	uint64_t buf_offset;
+	uint32_t size;
+	uint32_t checksum; /* ZIO_CHECKSUM_* */
+	/* checksummed with ci_func[1] rather than ci_func[0] */
+	uint32_t byteswap;
+	uint64_t cksum[4];
+} libzdb_plan_cblock_t;
+
+/*
+ * The extents of a map regrouped into one sequential stream of reads per
+ * device, e.g. for one reader thread per disk. Each byte of the file is
+ * read from one copy only. Each read records where its data goes both in
+ * the file and in a buffer covering the mapped part of the file,
+ * [buf_start, buf_end), so that the results can be scattered back into
+ * file order. Compressed blocks are read as is and must then be
+ * decompressed within the buffer, from a copy of their compressed data.
+ */
+typedef struct libzdb_plan {
+	const libzdb_map_t *map; /* must outlive the plan */
+	uint64_t buf_start;
+	uint64_t buf_end;
+	libzdb_plan_dev_t *devs; /* devices with at least one read */
+	size_t ndevs;
+	libzdb_plan_io_t *ios; /* the reads of every device, by device */
+	size_t nios;
+	libzdb_plan_zblock_t *zblocks; /* in file order */
+	size_t nzblocks;
+	libzdb_plan_cblock_t *cblocks; /* in file order */
+	size_t ncblocks;
+	/*
+	 * Copies of embedded payloads, whose dev_offset is their position in
+	 * the embedded payloads of the map, in file order
+	 */
+	libzdb_plan_io_t *embedded;
+	size_t nembedded;
+} libzdb_plan_t;
+
+/*
+ * Build the I/O plan of a map, reading each part of the file from the copy
+ * chosen by policy. latency is indexed like the device table of the map
+ * and only used by LIBZDB_COPY_LATENCY; NULL treats all devices alike.
+ * Returns 0 on success or an errno value on failure.
+ */
+int libzdb_plan_build(const libzdb_map_t *map, libzdb_copy_policy_t policy,
+    const uint64_t *latency, libzdb_plan_t **planp);
+
+/*
+ * Fold a read of length bytes of device dev that took ns nanoseconds into
+ * its exponentially weighted moving average latency, kept in nanoseconds
+ * per MiB. Devices without a sample yet have a latency of 0 and are
+ * preferred until they are measured.
+ */
+void libzdb_latency_update(
+    uint64_t *latency, uint32_t dev, uint64_t length, uint64_t ns);
+
+/* Write a plan to out as text. Returns 0 or an errno value on failure. */
+int libzdb_plan_write(const libzdb_plan_t *plan, FILE *out);
+
+void libzdb_plan_free(libzdb_plan_t *plan);
+
+/*
+ * A reader of file data straight from the devices of a pool, bypassing
+ * ZFS. Each device is read through its own io_uring with O_DIRECT, keeping
+ * up to depth reads of up to bufsize bytes in flight into buffers
+ * registered with the ring, from which the data is scattered into place.
+ * Requires liburing at build time.
+ */
+typedef struct libzdb_reader libzdb_reader_t;
+
+#define LIBZDB_READER_DEPTH 16
+#define LIBZDB_READER_BUFSIZE (1 << 20)
+
+/*
+ * Open a reader of the devices of the pool of map; a depth or bufsize of 0
+ * selects the defaults above. Devices are opened by the first read that
+ * needs them. The reader may be used while the session that made map is
+ * open. Returns 0 on success or an errno value on failure.
+ */
+int libzdb_reader_open(const libzdb_map_t *map, uint32_t depth,
+    size_t bufsize, libzdb_reader_t **readerp);
+
+/*
+ * Read the part of a file covered by plan into buf, which holds the file
+ * from plan->buf_start to plan->buf_end. The devices are read in parallel,
+ * embedded payloads are copied from the map and compressed blocks are then
+ * decompressed in place. Holes are not written to. If latency is not NULL,
+ * each read is folded into it as with libzdb_latency_update(). Returns 0
+ * on success, ECKSUM (EBADE) if the data of a block does not match its
+ * checksum, or another errno value on failure. Reads may be made from
+ * several threads at once; each device is read by one of them at a time.
+ */
+int libzdb_reader_read(libzdb_reader_t *reader, const libzdb_plan_t *plan,
+    void *buf, uint64_t *latency);
+
+/*
+ * Set whether the blocks of a plan are checked against their checksums, on
+ * their own threads as soon as their data is read, using the checksum
+ * implementations of libzpool. On by default.
+ */
+void libzdb_reader_set_verify(libzdb_reader_t *reader, int verify);
+
+void libzdb_reader_close(libzdb_reader_t *reader);
+
+/* A single file to map with libzdb_map_files() */
+typedef struct libzdb_request {
+	const char *dataset;
+	const char *path; /* NULL to map the file by object number */
+	uint64_t offset;  /* byte range to map, as in libzdb_map_range() */
+	uint64_t length;
+	int status; /* set on completion: 0 or an errno value */
+	uint64_t object;
+} libzdb_request_t;
+
+/* Called once per request as soon as its map has been written */
+typedef void libzdb_done_func_t(libzdb_request_t *req, void *arg);
+
+/*
+ * Map count files in parallel on nthreads worker threads, or one per online
+ * CPU if nthreads is not positive. The map of each request is written to
+ * out in the given format, in one piece and in completion order, and is
+ * followed by a call to done (if not NULL); calls to done are serialized.
+ * Returns the number of requests that failed.
+ */
+size_t libzdb_map_files(libzdb_session_t *session, libzdb_request_t *reqs,
+    size_t count, int nthreads, FILE *out, libzdb_format_t format,
+    libzdb_done_func_t *done, void *arg);
+
+/*
+ * Map the byte range [offset, offset + length) of every plain file of
+ * dataset, as libzdb_map_files() would, while the objset is scanned with
+ * libzdb_next_file(). Each map is written as soon as it is done; done gets
+ * a request whose path is NULL and whose object names the file. Returns the
+ * number of files that failed, plus one if the scan itself failed.
+ */
+size_t libzdb_map_dataset(libzdb_session_t *session, const char *dataset,
+    uint64_t offset, uint64_t length, int nthreads, FILE *out,
+    libzdb_format_t format, libzdb_done_func_t *done, void *arg);
+
+/* File data found on a device by libzdb_rmap_query() */
+typedef struct libzdb_rmap_entry {
+	uint64_t dev_offset; /* as in libzdb_extent_t */
+	uint64_t length;
+	uint64_t object; /* the file holding the data */
+	uint64_t file_offset; /* of the block if the data is compressed */
+} libzdb_rmap_entry_t;
+
+/* A reverse map from device locations to the files of a dataset */
+typedef struct libzdb_rmap libzdb_rmap_t;
+
+typedef void libzdb_rmap_func_t(const libzdb_rmap_entry_t *entry, void *arg);
+
+/*
+ * Map every plain file of dataset once and invert the extents, raidz data
+ * columns included, into a per-device index sorted by device offset. Files
+ * that cannot be mapped are reported and left out. Returns 0 on success or
+ * an errno value on failure.
+ */
+int libzdb_rmap_build(
+    libzdb_session_t *session, const char *dataset, libzdb_rmap_t **rmapp);
+
+/*
+ * Call func (if not NULL) for each entry of the device named dev that
+ * overlaps the byte range [offset, offset + length) of the device, in
+ * device offset order. Takes logarithmic time plus the number of entries
+ * found, which is returned.
+ */
+size_t libzdb_rmap_query(const libzdb_rmap_t *rmap, const char *dev,
+    uint64_t offset, uint64_t length, libzdb_rmap_func_t *func, void *arg);
+
+void libzdb_rmap_free(libzdb_rmap_t *rmap);
+
+/* Disown all datasets held by a session and shut the zfs kernel down */
+void libzdb_close(libzdb_session_t *session);
+
+#endif
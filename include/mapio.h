@@ -0,0 +1,29 @@
+#ifndef C2_LIBZDB_MAPIO_H
+#define C2_LIBZDB_MAPIO_H
+
+#include "libzdb.h"
+
+/*
+ * Sizes of the fixed-size records of LIBZDB_FORMAT_BINARY, laid out in
+ * libzdb.h: the header up to the dataset name (magic, version and ndevs,
+ * eight u64, cksum_salt, dataset_len), a block (two u64, six u32, four u8
+ * and cksum) and an extent (two u32, three u64, block, child and col)
+ */
+#define MAPIO_HEADER_SIZE (8 + 2 * 4 + 8 * 8 + 32 + 4)
+#define MAPIO_BLOCK_SIZE (2 * 8 + 6 * 4 + 4 + 4 * 8)
+#define MAPIO_EXTENT_SIZE (2 * 4 + 3 * 8 + 2 * 4)
+
+/* Write map to out as LIBZDB_FORMAT_BINARY */
+void mapio_write(const libzdb_map_t *map, FILE *out);
+
+/*
+ * Read a map written by mapio_write() from in into the txg, file size,
+ * blocks, extents and embedded payloads of map, whose pool GUID, object and
+ * device table have been set: the map read must be of the same object of
+ * the same pool, with the same devices on the same vdevs in the same
+ * states (dev_health). Returns 0 on success, or ENOENT if in holds no such
+ * map.
+ */
+int mapio_read(FILE *in, libzdb_map_t *map);
+
+#endif
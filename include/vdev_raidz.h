@@ -1,9 +1,52 @@
 #ifndef C2_VDEV_RAIDZ
 #define C2_VDEV_RAIDZ
 
+#include <sys/vdev_raidz_impl.h>
 #include <sys/zio.h>
 
-void vdev_raidz_map_alloc(zio_t *zio, uint64_t ashift, uint64_t dcols,
-    uint64_t nparity, char **backing, uint64_t actual_size);
+/* Size of a raidz map with room for the columns of dcols children */
+#define VDEV_RAIDZ_MAP_SIZE(dcols) offsetof(raidz_map_t, rm_col[dcols])
+
+/*
+ * Compute into rm, of at least VDEV_RAIDZ_MAP_SIZE(dcols) bytes, the raidz
+ * column layout of the block at zio->io_offset of size zio->io_size. Column
+ * offsets are relative to the start of the allocatable space of each child,
+ * i.e. exclude the front vdev labels. This is the layout of a single block
+ * that vdev_raidz_map_batch() is tested against.
+ */
+void vdev_raidz_map_init(raidz_map_t *rm, zio_t *zio, uint64_t ashift,
+    uint64_t dcols, uint64_t nparity);
+
+/* Division by a fixed divisor through a multiply by its reciprocal */
+typedef struct raidz_recip {
+	uint64_t d;
+	uint64_t m; /* floor((2^64 - 1) / d) */
+} raidz_recip_t;
+
+/* A raidz vdev, with the divisions by its width precomputed */
+typedef struct vdev_raidz_geom {
+	uint64_t ashift;
+	uint64_t dcols;
+	uint64_t nparity;
+	raidz_recip_t by_dcols;
+	raidz_recip_t by_ndata; /* dcols - nparity */
+} vdev_raidz_geom_t;
+
+void vdev_raidz_geom_init(vdev_raidz_geom_t *geom, uint64_t ashift,
+    uint64_t dcols, uint64_t nparity);
+
+/*
+ * Compute the data columns of count blocks of a raidz vdev. Block i is
+ * io_size[i] bytes at io_offset[i], of which the first actual_size[i] bytes
+ * hold data. The columns are written as a structure of arrays with a stride
+ * of dcols - nparity: column k of block i, at index i * (dcols - nparity) +
+ * k, holds size bytes of the block in data order at offset (excluding the
+ * front vdev labels) of child devidx. ncols[i] is the number of non-empty
+ * columns, which come first. Returns the total number of non-empty columns.
+ */
+size_t vdev_raidz_map_batch(const vdev_raidz_geom_t *geom, size_t count,
+    const uint64_t *io_offset, const uint64_t *io_size,
+    const uint64_t *actual_size, uint32_t *ncols, uint32_t *devidx,
+    uint64_t *offset, uint64_t *size);
 
 #endif
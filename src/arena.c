@@ -0,0 +1,116 @@
+#include "arena.h"
+
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN alignof(max_align_t)
+
+struct chunk {
+	chunk_t *next; /* older chunk */
+	size_t size;
+	size_t used;
+	alignas(max_align_t) unsigned char data[];
+};
+
+static chunk_t *
+chunk_alloc(size_t size, chunk_t *next)
+{
+	chunk_t *chunk = malloc(sizeof(chunk_t) + size);
+	if (!chunk) {
+		return NULL;
+	}
+
+	chunk->next = next;
+	chunk->size = size;
+	chunk->used = 0;
+
+	return chunk;
+}
+
+static void
+chunk_free(chunk_t *chunk)
+{
+	while (chunk) {
+		chunk_t *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+}
+
+void
+c2arena_init(c2arena_t *arena, size_t chunk_size)
+{
+	arena->head = NULL;
+	arena->chunk_size = chunk_size;
+}
+
+void *
+c2arena_alloc(c2arena_t *arena, size_t size)
+{
+	chunk_t *chunk = arena->head;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	if (!chunk || chunk->size - chunk->used < size) {
+		const size_t chunk_size =
+		    size > arena->chunk_size ? size : arena->chunk_size;
+		if (!(chunk = chunk_alloc(chunk_size, arena->head))) {
+			return NULL;
+		}
+		arena->head = chunk;
+	}
+
+	void *ptr = chunk->data + chunk->used;
+	chunk->used += size;
+
+	return ptr;
+}
+
+char *
+c2arena_strdup(c2arena_t *arena, const char *str)
+{
+	const size_t len = strlen(str) + 1;
+	char *copy = c2arena_alloc(arena, len);
+
+	if (copy) {
+		memcpy(copy, str, len);
+	}
+
+	return copy;
+}
+
+/*
+ * Release every allocation. The memory is kept for reuse as a single chunk
+ * large enough for everything that was allocated, so that an arena serving
+ * similar requests over and over settles without calling malloc().
+ */
+void
+c2arena_reset(c2arena_t *arena)
+{
+	chunk_t *chunk = arena->head;
+
+	if (!chunk) {
+		return;
+	}
+
+	if (chunk->next) {
+		size_t total = 0;
+		for (; chunk; chunk = chunk->next) {
+			total += chunk->size;
+		}
+
+		chunk_free(arena->head);
+		arena->head = chunk_alloc(total, NULL);
+		return;
+	}
+
+	chunk->used = 0;
+}
+
+void
+c2arena_fin(c2arena_t *arena)
+{
+	chunk_free(arena->head);
+	arena->head = NULL;
+}
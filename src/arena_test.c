@@ -0,0 +1,113 @@
+#include "arena.h"
+#include "test.h"
+
+#include <stdalign.h>
+#include <stdint.h>
+
+#define ALIGN alignof(max_align_t)
+
+/* Allocations of any size are aligned for any type and do not overlap */
+static void
+test_alignment(void)
+{
+	c2arena_t arena;
+	unsigned char *ptrs[64];
+
+	c2arena_init(&arena, 256);
+	for (size_t i = 0; i < 64; i++) {
+		ptrs[i] = c2arena_alloc(&arena, i + 1);
+		CHECK(ptrs[i] != NULL);
+		CHECK((uintptr_t) ptrs[i] % ALIGN == 0);
+		memset(ptrs[i], (int) i, i + 1);
+	}
+	for (size_t i = 0; i < 64; i++) {
+		for (size_t k = 0; k <= i; k++) {
+			CHECK(ptrs[i][k] == i);
+		}
+	}
+
+	c2arena_fin(&arena);
+	CHECK(arena.head == NULL);
+}
+
+/* An allocation larger than a chunk gets a chunk of its own */
+static void
+test_oversized(void)
+{
+	c2arena_t arena;
+
+	c2arena_init(&arena, 64);
+	unsigned char *small = c2arena_alloc(&arena, 16);
+	unsigned char *big = c2arena_alloc(&arena, 1000);
+	unsigned char *next = c2arena_alloc(&arena, 16);
+
+	CHECK(small != NULL && big != NULL && next != NULL);
+	memset(big, 0xa5, 1000);
+	memset(small, 0x5a, 16);
+	memset(next, 0x3c, 16);
+	CHECK(big[0] == 0xa5 && big[999] == 0xa5);
+	CHECK(small[15] == 0x5a);
+
+	c2arena_fin(&arena);
+}
+
+/*
+ * Once reset, the memory of several chunks is kept as one chunk, from which
+ * the same allocations are carved contiguously, at the same addresses after
+ * every further reset
+ */
+static void
+test_reset(void)
+{
+	c2arena_t arena;
+	const size_t size = 3 * ALIGN;
+	unsigned char *first;
+
+	c2arena_init(&arena, 4 * size);
+	for (int i = 0; i < 10; i++) {
+		CHECK(c2arena_alloc(&arena, size) != NULL);
+	}
+
+	c2arena_reset(&arena);
+	first = c2arena_alloc(&arena, size);
+	CHECK(first != NULL);
+	for (int i = 1; i < 10; i++) {
+		CHECK(c2arena_alloc(&arena, size) == first + i * size);
+	}
+
+	c2arena_reset(&arena);
+	CHECK(c2arena_alloc(&arena, size) == first);
+
+	/* a finished arena has nothing to keep */
+	c2arena_fin(&arena);
+	c2arena_reset(&arena);
+	CHECK(arena.head == NULL);
+}
+
+static void
+test_strdup(void)
+{
+	c2arena_t arena;
+	const char *name = "/dev/disk/by-id/wwn-0x5000c500a1b2c3d4";
+
+	c2arena_init(&arena, 16);
+	char *copy = c2arena_strdup(&arena, name);
+	char *empty = c2arena_strdup(&arena, "");
+
+	CHECK(copy != NULL && copy != name && strcmp(copy, name) == 0);
+	CHECK(empty != NULL && empty[0] == '\0');
+	CHECK((uintptr_t) empty % ALIGN == 0);
+
+	c2arena_fin(&arena);
+}
+
+int
+main(void)
+{
+	test_alignment();
+	test_oversized();
+	test_reset();
+	test_strdup();
+
+	return (test_report());
+}
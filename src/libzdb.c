@@ -36,10 +36,14 @@
  * Copyright (c) 2022 Triad National Security, LLC as operator of Los Alamos
  *     National Laboratory. All rights reserved.
  */
-#include "libnvpair.h"
+#include "arena.h"
+#include "libzdb.h"
 #include "list.h"
+#include "mapio.h"
 #include "vdev_raidz.h"
 
+#include <sys/abd.h>
+#include <sys/blkptr.h>
 #include <sys/dbuf.h>
 #include <sys/dmu.h>
 #include <sys/dmu_objset.h>
@@ -50,53 +54,152 @@
 #include <sys/zfs_sa.h>
 #include <sys/zfs_znode.h>
 #include <sys/zio.h>
+#include <sys/zio_checksum.h>
 
-/* Information retrieved from a L0 block pointer of a given plain zfs file */
-typedef struct info {
-	/* Logical offset of the file */
-	uint64_t file_offset;
-	/*
-	 * Logical amount of file data represented by the block. Logical file
-	 * size may still be larger than true file size (size reported by `ls`)
-	 * due to potential data padding within a block or an ashift
-	 */
-	uint64_t file_data;
-	/*
-	 * Physical amount of file data stored on disk. Less amount of data may
-	 * be written to disk due to data compression or holes in a file
-	 */
-	uint64_t physical_file_data;
-	uint64_t vdev;	 /* Top-level vdev that stored the data */
-	uint64_t offset; /* Offset to the vdev */
-	/*
-	 * Actual size of data on vdev. On raidz vdevs, this size includes
-	 * parity data and will be greater than the physical file size
-	 */
-	uint64_t asize;
-} info_t;
+typedef enum {
+	STRIPE,
+	RAIDZ,
+	MIRROR,
+	HOLE, /* no devices */
+} zpool_type_t;
 
 /* a single vdev within a zpool */
 typedef struct zpool_vdev {
-	char **names;
+	char **names;	 /* points into the device table of the zpool */
+	size_t dev_base; /* device table index of names[0] */
 	zpool_type_t type;
 	size_t count;
 	size_t nparity;
 	size_t ashift;
+	size_t nhealthy; /* devices in VDEV_STATE_HEALTHY */
+	vdev_raidz_geom_t geom; /* set for RAIDZ vdevs */
 } zpool_vdev_t;
 
 /* a single zpool */
 typedef struct zpool_vdevs {
 	zpool_vdev_t *vdevs;
 	size_t count;
+	char **devs; /* backing device names of every vdev, in vdev order */
+	uint32_t *dev_vdevs; /* top-level vdev of each device */
+	uint64_t *states; /* vdev_state_t of each device, when loaded */
+	uint64_t health;  /* hash of states */
+	size_t ndevs;
+	c2arena_t arena; /* holds vdevs, devs and the device names */
 } zpool_vdevs_t;
 
-static sa_attr_type_t *sa_attr_table = NULL;
-static char curpath[PATH_MAX];
+/* a zpool whose vdev topology has been loaded by a session */
+typedef struct zdb_pool {
+	char *name;
+	zpool_vdevs_t *vdevs;
+} zdb_pool_t;
+
+/* a resolved directory entry */
+typedef struct zdb_dentry {
+	struct zdb_dentry *next; /* in the same hash bucket */
+	uint64_t hash;
+	uint64_t parent;
+	uint64_t child;
+	dmu_object_type_t type; /* of the child */
+	char name[];
+} zdb_dentry_t;
+
+/*
+ * Directory entries resolved by path lookups, so that the lookups of many
+ * files under the same directories do not repeat the same zap_lookup()
+ * calls. Entries are kept as long as the dataset is owned: a session sees
+ * the dataset as it was when it was owned.
+ */
+typedef struct zdb_dcache {
+	krwlock_t lock;
+	zdb_dentry_t **buckets;
+	size_t nbuckets; /* a power of 2 */
+	size_t count;
+	c2arena_t arena; /* holds the entries */
+} zdb_dcache_t;
+
+/* a dataset owned by a session, kept open until the session is closed */
+typedef struct zdb_dataset {
+	char *name;
+	objset_t *os;
+	sa_attr_type_t *sa_attr_table;
+	uint64_t root_obj;
+	zdb_dcache_t dcache;
+} zdb_dataset_t;
+
+struct libzdb_session {
+	char *cachefile;
+	kmutex_t lock;	   /* protects pools and datasets */
+	c2list_t pools;	   /* zdb_pool_t */
+	c2list_t datasets; /* zdb_dataset_t */
+	/* max child indirect block reads kept in flight per tree level */
+	uint32_t prefetch;
+	int coalesce;
+	char *cachedir; /* extent map cache, NULL if disabled */
+	libzdb_copy_policy_t policy;
+	/* idle request arenas, protected by lock */
+	c2arena_t **arenas;
+	size_t narenas;
+	size_t arenas_cap;
+};
+
+/* a byte range of a file, [start, end) */
+typedef struct zdb_range {
+	uint64_t start;
+	uint64_t end;
+} zdb_range_t;
+
+/*
+ * File ranges whose block pointers were born after the txg of the map being
+ * updated, or are holes, in file order. The extents of the previous map
+ * within these ranges are replaced by those found by the walk.
+ */
+typedef struct zdb_changes {
+	zdb_range_t *ranges;
+	size_t count;
+	size_t cap;
+} zdb_changes_t;
+
+/* Copy d > 0 of a block, i.e. another DVA of its block pointer */
+typedef struct zdb_copy {
+	uint64_t offset;
+	uint32_t vdev;
+	uint32_t block; /* index of the block in the map */
+} zdb_copy_t;
 
-static uint8_t dump_opt[256];
+/*
+ * Copy d of the blocks of the map being made that have one, in block order.
+ * Blocks only keep their first copy, so the others are only kept until the
+ * extents of the map are built.
+ */
+typedef struct zdb_copies {
+	zdb_copy_t *copies;
+	size_t count;
+	size_t cap;
+} zdb_copies_t;
+
+/*
+ * State of a single mapping request. Each request, and so each worker
+ * thread, has its own context; everything it points to in the session is
+ * either read-only or protected by the session lock.
+ */
+typedef struct zdb_ctx {
+	libzdb_session_t *session;
+	char curpath[PATH_MAX];
+	/* byte range of the file to map, [range_start, range_end) */
+	uint64_t range_start;
+	uint64_t range_end;
+	/* the map being updated by libzdb_remap(), NULL for a full walk */
+	const libzdb_map_t *prev;
+	zdb_changes_t *changes;
+	/* copies[d - 1] holds copy d of the blocks of the map */
+	zdb_copies_t *copies;
+	/* scratch memory of the request, released when it completes */
+	c2arena_t *arena;
+} zdb_ctx_t;
 
 static int
-open_objset(const char *path, dmu_objset_type_t type, void *tag, objset_t **osp)
+open_objset(const char *path, dmu_objset_type_t type, void *tag, objset_t **osp,
+    sa_attr_type_t **sa_attr_table)
 {
 	int err;
 	uint64_t sa_attrs = 0;
@@ -117,11 +220,12 @@ open_objset(const char *path, dmu_objset_type_t type, void *tag, objset_t **osp)
 			    &sa_attrs);
 		}
 		err = sa_setup(
-		    *osp, sa_attrs, zfs_attr_table, ZPL_END, &sa_attr_table);
+		    *osp, sa_attrs, zfs_attr_table, ZPL_END, sa_attr_table);
 		if (err != 0) {
 			fprintf(stderr, "sa_setup failed: %s\n", strerror(err));
 			dmu_objset_disown(*osp, B_FALSE, tag);
 			*osp = NULL;
+			return (err);
 		}
 	}
 
@@ -134,51 +238,115 @@ close_objset(objset_t *os, void *tag)
 	if (os->os_sa != NULL)
 		sa_tear_down(os);
 	dmu_objset_disown(os, B_FALSE, tag);
-	sa_attr_table = NULL;
 }
 
+/*
+ * Keep the checksum of the physical data of bp in info, if any, and
+ * whether the data of the block was written by a host of the other byte
+ * order, by which zio_checksum_error_impl() picks the checksum function
+ */
+static void
+block_set_checksum(libzdb_block_t *info, const blkptr_t *bp)
+{
+	info->flags &= ~(LIBZDB_BLOCK_CHECKSUM | LIBZDB_BLOCK_BYTESWAP);
+	if (BP_IS_HOLE(bp) || BP_GET_CHECKSUM(bp) == ZIO_CHECKSUM_OFF) {
+		return;
+	}
+
+	info->flags |= LIBZDB_BLOCK_CHECKSUM;
+	if (BP_SHOULD_BYTESWAP(bp)) {
+		info->flags |= LIBZDB_BLOCK_BYTESWAP;
+	}
+	info->checksum = BP_GET_CHECKSUM(bp);
+	for (int i = 0; i < 4; i++) {
+		info->cksum[i] = bp->blk_cksum.zc_word[i];
+	}
+}
+
+/*
+ * Keep the DVAs of bp as the copies of block b of the map: the first in
+ * info, the others in copies
+ */
 static void
-snprintf_blkptr_compact(
-    char *blkbuf, size_t buflen, const blkptr_t *bp, info_t *info)
+block_set_dvas(libzdb_block_t *info, const blkptr_t *bp, zdb_copies_t *copies,
+    size_t b)
 {
 	const dva_t *dva = bp->blk_dva;
-	int ndvas = dump_opt['d'] > 5 ? BP_GET_NDVAS(bp) : 1;
-	int i;
 
-	if (dump_opt['b'] >= 6) {
-		snprintf_blkptr(blkbuf, buflen, bp);
-		return;
+	info->vdev = DVA_GET_VDEV(&dva[0]);
+	info->offset = DVA_GET_OFFSET(&dva[0]);
+
+	/* data blocks have more than 1 dva with copies=2 or 3 */
+	for (int i = 1; i < info->ndvas; i++) {
+		zdb_copies_t *c = &copies[i - 1];
+
+		if (c->count == c->cap) {
+			c->cap = c->cap ? c->cap * 2 : 16;
+			c->copies =
+			    realloc(c->copies, c->cap * sizeof(zdb_copy_t));
+		}
+		c->copies[c->count].offset = DVA_GET_OFFSET(&dva[i]);
+		c->copies[c->count].vdev = DVA_GET_VDEV(&dva[i]);
+		c->copies[c->count].block = b;
+		c->count++;
 	}
+}
 
+/* Fill info from bp if it is a L0 block pointer */
+static void
+block_from_bp(const blkptr_t *bp, libzdb_block_t *info)
+{
 	if (BP_IS_EMBEDDED(bp)) {
-		sprintf(blkbuf, "EMBEDDED et=%u %llxL/%llxP B=%llu",
-		    (int) BPE_GET_ETYPE(bp), (u_longlong_t) BPE_GET_LSIZE(bp),
-		    (u_longlong_t) BPE_GET_PSIZE(bp),
-		    (u_longlong_t) bp->blk_birth);
+		/* the payload is kept by print_indirect() */
+		if (BP_GET_LEVEL(bp) == 0 &&
+		    BPE_GET_ETYPE(bp) == BP_EMBEDDED_TYPE_DATA) {
+			info->file_data = BPE_GET_LSIZE(bp);
+			info->physical_file_data = BPE_GET_PSIZE(bp);
+			info->compress = BP_GET_COMPRESS(bp);
+			info->flags = LIBZDB_BLOCK_EMBEDDED;
+		}
 		return;
 	}
 
-	blkbuf[0] = '\0';
+	if (BP_GET_LEVEL(bp) != 0) {
+		return;
+	}
 
-	/* data blocks should only have 1 dva */
-	for (i = 0; i < ndvas; i++) {
-		/* snprintf (blkbuf + strlen (blkbuf), buflen - strlen
-		 * (blkbuf),
-		 */
-		/*           "%llu:%llx:%llx ",
-		 * (u_longlong_t)DVA_GET_VDEV
-		 * (&dva[i]), */
-		/*           (u_longlong_t)DVA_GET_OFFSET (&dva[i]), */
-		/*           (u_longlong_t)DVA_GET_ASIZE (&dva[i])); */
-		if (BP_GET_LEVEL(bp) == 0) {
-			info->file_data = BP_GET_LSIZE(bp);
-			info->physical_file_data =
-			    BP_IS_HOLE(bp) ? 0 : BP_GET_PSIZE(bp);
-			info->vdev = DVA_GET_VDEV(&dva[i]);
-			info->offset = DVA_GET_OFFSET(&dva[i]);
-			info->asize = DVA_GET_ASIZE(&dva[i]);
-		}
+	info->file_data = BP_GET_LSIZE(bp);
+	info->physical_file_data = BP_IS_HOLE(bp) ? 0 : BP_GET_PSIZE(bp);
+	info->compress = BP_GET_COMPRESS(bp);
+	info->ndvas = BP_IS_HOLE(bp) ? 0 : BP_GET_NDVAS(bp);
+	block_set_checksum(info, bp);
+}
+
+/* Whether a block is stored compressed, i.e. its extents hold psize bytes */
+static inline boolean_t
+block_compressed(const libzdb_block_t *info)
+{
+	return (info->physical_file_data != 0 &&
+	    info->compress != ZIO_COMPRESS_OFF);
+}
+
+/* Physical data of a block held by its copies, a part of it for gang members */
+static inline uint64_t
+block_psize(const libzdb_block_t *info)
+{
+	return ((info->flags & LIBZDB_BLOCK_GANG) ? info->gang_size
+						  : info->physical_file_data);
+}
+
+/*
+ * Copy i of a run of copies of the blocks of map: block i itself for the
+ * first copies, copies->copies[i] for the others
+ */
+static inline zdb_copy_t
+copy_at(const libzdb_map_t *map, const zdb_copies_t *copies, size_t i)
+{
+	if (copies == NULL) {
+		const libzdb_block_t *info = &map->blocks[i];
+		return ((zdb_copy_t){info->offset, info->vdev, i});
 	}
+	return (copies->copies[i]);
 }
 
 static uint64_t
@@ -200,520 +368,2567 @@ blkid2offset(
 	    << SPA_MINBLOCKSHIFT);
 }
 
+/* Make room for at least count more blocks in map */
 static void
-print_indirect(blkptr_t *bp, const zbookmark_phys_t *zb,
-    const dnode_phys_t *dnp, c2list_t *list)
+map_reserve_blocks(libzdb_map_t *map, size_t count)
 {
-	char blkbuf[BP_SPRINTF_LEN];
-	int l;
-
-	if (!BP_IS_EMBEDDED(bp)) {
-		ASSERT3U(BP_GET_TYPE(bp), ==, dnp->dn_type);
-		ASSERT3U(BP_GET_LEVEL(bp), ==, zb->zb_level);
-	}
-
-	/* printf ("%16llx ", (u_longlong_t)blkid2offset (dnp, bp, zb)); */
-
-	/* ASSERT (zb->zb_level >= 0); */
-
-	/* for (l = dnp->dn_nlevels - 1; l >= -1; l--) */
-	/*   { */
-	/*     if (l == zb->zb_level) */
-	/*       { */
-	/*         printf ("L%llx", (u_longlong_t)zb->zb_level); */
-	/*       } */
-	/*     else */
-	/*       { */
-	/*         printf (" "); */
-	/*       } */
-	/*   } */
-
-	info_t *info = malloc(sizeof(info_t));
-	snprintf_blkptr_compact(blkbuf, sizeof(blkbuf), bp, info);
-	if (BP_GET_LEVEL(bp) == 0) {
-		info->file_offset = blkid2offset(dnp, bp, zb);
-		c2list_pushback(list, info);
-	} else {
-		free(info);
+	if (map->blocks_cap - map->nblocks >= count) {
+		return;
 	}
 
-	/* printf ("%s\n", blkbuf); */
+	map->blocks_cap = map->nblocks + count;
+	map->blocks =
+	    realloc(map->blocks, map->blocks_cap * sizeof(libzdb_block_t));
 }
 
-static int
-visit_indirect(spa_t *spa, const dnode_phys_t *dnp, blkptr_t *bp,
-    const zbookmark_phys_t *zb, c2list_t *list)
+/*
+ * Make room for len more bytes of embedded payloads in map and return their
+ * offset
+ */
+static uint64_t
+map_add_embedded(libzdb_map_t *map, size_t len)
 {
-	int err = 0;
-
-	if (bp->blk_birth == 0)
-		return (0);
-
-	print_indirect(bp, zb, dnp, list);
-
-	if (BP_GET_LEVEL(bp) > 0 && !BP_IS_HOLE(bp)) {
-		arc_flags_t flags = ARC_FLAG_WAIT;
-		int i;
-		blkptr_t *cbp;
-		int epb = BP_GET_LSIZE(bp) >> SPA_BLKPTRSHIFT;
-		arc_buf_t *buf;
-		uint64_t fill = 0;
-
-		err = arc_read(NULL, spa, bp, arc_getbuf_func, &buf,
-		    ZIO_PRIORITY_ASYNC_READ, ZIO_FLAG_CANFAIL, &flags, zb);
-		if (err)
-			return (err);
-		ASSERT(buf->b_data);
-
-		/* recursively visit blocks below this */
-		cbp = buf->b_data;
-		for (i = 0; i < epb; i++, cbp++) {
-			zbookmark_phys_t czb;
-
-			SET_BOOKMARK(&czb, zb->zb_objset, zb->zb_object,
-			    zb->zb_level - 1, zb->zb_blkid * epb + i);
-			err = visit_indirect(spa, dnp, cbp, &czb, list);
-			if (err)
-				break;
-			fill += BP_GET_FILL(cbp);
-		}
-		if (!err)
-			ASSERT3U(fill, ==, BP_GET_FILL(bp));
-		arc_buf_destroy(buf, &buf);
+	if (map->embedded_cap - map->embedded_len < len) {
+		map->embedded_cap =
+		    MAX(map->embedded_cap * 2, map->embedded_len + len);
+		map->embedded = realloc(map->embedded, map->embedded_cap);
 	}
 
-	return (err);
+	const uint64_t offset = map->embedded_len;
+	map->embedded_len += len;
+	return (offset);
 }
 
-static void
-dump_indirect(dnode_t *dn, const size_t file_size, c2list_t *list)
+/* Append a zeroed block to map and return it */
+static libzdb_block_t *
+map_add_block(libzdb_map_t *map)
 {
-	dnode_phys_t *dnp = dn->dn_phys;
-	int j;
-	zbookmark_phys_t czb;
-
-	SET_BOOKMARK(&czb, dmu_objset_id(dn->dn_objset), dn->dn_object,
-	    dnp->dn_nlevels - 1, 0);
-	for (j = 0; j < dnp->dn_nblkptr; j++) {
-		czb.zb_blkid = j;
-		visit_indirect(dmu_objset_spa(dn->dn_objset), dnp,
-		    &dnp->dn_blkptr[j], &czb, list);
+	if (map->nblocks == map->blocks_cap) {
+		map_reserve_blocks(map, MAX(map->blocks_cap, 16));
 	}
 
-	/* printf ("\n"); */
+	libzdb_block_t *info = &map->blocks[map->nblocks++];
+	memset(info, 0, sizeof(libzdb_block_t));
+	return (info);
 }
 
-static uint64_t
-dump_znode(objset_t *os, uint64_t object, void *data, size_t size)
-{
-	sa_handle_t *hdl;
-	uint64_t fsize;
-	sa_bulk_attr_t bulk[1];
-	int idx = 0;
+/*
+ * The gang header of a gang block, read ahead of the walk, and the trees of
+ * its members that are gang blocks themselves, as zio_gang_node_t
+ */
+typedef struct zdb_gang {
+	blkptr_t bp;
+	zbookmark_phys_t zb;
+	abd_t *abd; /* holds the header once read */
+	int err;
+	struct zdb_gang *child[SPA_GBH_NBLKPTRS];
+} zdb_gang_t;
 
-	if (sa_handle_get(os, object, NULL, SA_HDL_PRIVATE, &hdl)) {
-		printf("Failed to get handle for SA znode\n");
-		return (0);
+static void
+gang_free(zdb_gang_t *gn)
+{
+	if (gn == NULL) {
+		return;
 	}
 
-	SA_ADD_BULK_ATTR(bulk, idx, sa_attr_table[ZPL_SIZE], NULL, &fsize, 8);
-	if (sa_bulk_lookup(hdl, bulk, idx)) {
-		sa_handle_destroy(hdl);
-		return (0);
+	for (int g = 0; g < SPA_GBH_NBLKPTRS; g++) {
+		gang_free(gn->child[g]);
 	}
-
-	/* printf ("\tsize      %llu\n", (u_longlong_t)fsize); */
-	sa_handle_destroy(hdl);
-	return (fsize);
+	if (gn->abd != NULL) {
+		abd_free(gn->abd);
+	}
+	free(gn);
 }
 
 static void
-dump_object(objset_t *os, uint64_t object, zpool_vdevs_t *vdevs)
+gangs_free(zdb_gang_t **gangs, size_t count)
 {
-	dmu_buf_t *db = NULL;
-	dmu_object_info_t doi;
-	dnode_t *dn = NULL;
-	void *bonus = NULL;
-	size_t bsize = 0;
-	int error;
-
-	error = dmu_object_info(os, object, &doi);
-	if (error) {
-		fprintf(stderr, "dmu_object_info() failed, errno %u\n", error);
+	if (gangs == NULL) {
 		return;
 	}
 
-	error = dmu_bonus_hold(os, object, FTAG, &db);
-	if (error) {
-		fprintf(stderr, "dmu_bonus_hold(%lu) failed, errno %u", object,
-		    error);
-		return;
+	for (size_t i = 0; i < count; i++) {
+		gang_free(gangs[i]);
 	}
-	bonus = db->db_data;
-	bsize = db->db_size;
-	dn = DB_DNODE((dmu_buf_impl_t *) db);
+	free(gangs);
+}
 
-	const uint64_t fsize = dump_znode(os, object, bonus, bsize);
+static void
+gang_read_done(zio_t *zio)
+{
+	zdb_gang_t *gn = zio->io_private;
 
-	c2list_t block_list;
-	c2list_init(&block_list);
+	gn->err = zio->io_error;
+}
 
-	dump_indirect(dn, doi.doi_max_offset, &block_list);
+/*
+ * Read the gang trees of the count nodes of gangs that are not NULL. The
+ * headers at the same depth of every tree are read in one round, under a
+ * single root zio, and their members that are gang blocks make the next
+ * round. Like zio_gang_tree_issue(), headers are read as gang children so
+ * that they are neither ganged nor decompressed.
+ */
+static int
+gang_read(spa_t *spa, zdb_gang_t **gangs, size_t count)
+{
+	zdb_gang_t **round = malloc(MAX(count, 1) * sizeof(zdb_gang_t *));
+	size_t n = 0;
+	int err = 0;
 
-	printf("file size: %zu (%zu L0 BPs)\n", fsize, block_list.count);
+	for (size_t i = 0; i < count; i++) {
+		if (gangs[i] != NULL) {
+			round[n++] = gangs[i];
+		}
+	}
 
-	/* Add an extra node to the list as an end-of-the-list guard */
-	info_t *extra = malloc(sizeof(info_t));
-	extra->file_offset = fsize;
-	c2list_pushback(&block_list, extra);
-	uint64_t remaining_fsize = fsize;
+	while (n > 0 && !err) {
+		zio_t *rio = zio_root(spa, NULL, NULL, ZIO_FLAG_CANFAIL);
 
-	for (node_t *node = c2list_head(&block_list); node && c2list_next(node);
-	     node = c2list_next(node)) {
-		node_t *next_node = c2list_next(node);
+		for (size_t i = 0; i < n; i++) {
+			zdb_gang_t *gn = round[i];
 
-		info_t *info = c2list_get(node);
-		info_t *next = c2list_get(next_node);
+			gn->abd = abd_alloc_linear(SPA_GANGBLOCKSIZE, B_TRUE);
+			zio_nowait(zio_read(rio, spa, &gn->bp, gn->abd,
+			    SPA_GANGBLOCKSIZE, gang_read_done, gn,
+			    ZIO_PRIORITY_SYNC_READ,
+			    ZIO_FLAG_CANFAIL | ZIO_FLAG_GANG_CHILD, &gn->zb));
+		}
+		err = zio_wait(rio);
 
-		zpool_vdev_t *vdev = &vdevs->vdevs[info->vdev];
+		zdb_gang_t **next = NULL;
+		size_t nnext = 0;
+		size_t cap = 0;
 
-		/*
-		 * If a given block is a hole physical_file_data will be
-		 * zero and we skip the block. Otherwise, we bound the
-		 * record size to never exceed true file size. THIS ONLY
-		 * MAKES SENSE WHEN ZFS COMPRESSION IS DISABLED WHICH IS
-		 * INDEED THE CASE WE ASSUME. Note that
-		 * "next->file_offset - info->file_offset" can be
-		 * greater than remaining_fsize when *next happens to be
-		 * a hole. Yes, zfs may insert a hole even at the very
-		 * end of a file!
-		 */
-		const uint64_t actual_size =
-		    MIN((MIN(next->file_offset - info->file_offset,
-			    info->physical_file_data)),
-			remaining_fsize);
-		/*
-		 * Logical file data may be greater than true file size due to
-		 * zfs-introduced padding within a block or an ashift.
-		 */
-		remaining_fsize -= MIN(remaining_fsize, info->file_data);
+		for (size_t i = 0; i < n && !err; i++) {
+			zdb_gang_t *gn = round[i];
+			zio_gbh_phys_t *gbh = abd_to_buf(gn->abd);
 
-		printf("BP: file_offset=%ld, file_data=%ld, "
-		       "physical_file_data=%ld, "
-		       "vdev=%ld, io_offset=%ld, record_size=%ld, "
-		       "effective_record_size=%ld\n",
-		    info->file_offset, info->file_data,
-		    info->physical_file_data, info->vdev, info->offset,
-		    info->physical_file_data, actual_size);
+			if (gn->err) {
+				err = gn->err;
+				break;
+			}
+			if (BP_SHOULD_BYTESWAP(&gn->bp)) {
+				byteswap_uint64_array(gbh, SPA_GANGBLOCKSIZE);
+			}
 
-		if (actual_size != 0) {
-			zio_t zio;
-			zio.io_offset = info->offset;
-			/* Physical file data is always a multiple of ashift */
-			zio.io_size = info->physical_file_data;
+			for (int g = 0; g < SPA_GBH_NBLKPTRS; g++) {
+				const blkptr_t *gbp = &gbh->zg_blkptr[g];
 
-			switch (vdev->type) {
-			case STRIPE:
-				if (vdev->count != 1) {
-					fprintf(stderr,
-					    "Warning: Found multiple devices "
-					    "when only 1 is expected.\n");
+				if (BP_IS_HOLE(gbp) || !BP_IS_GANG(gbp)) {
+					continue;
 				}
-				/* fallthrough */
-			case MIRROR:
-				printf("vdevidx=%ld "
-				       "dev=%s "
-				       "offset=%llu "
-				       "size=%lu\n",
-				    info->vdev, vdev->names[0],
-				    info->offset + VDEV_LABEL_START_SIZE,
-				    actual_size);
-
-				break;
-			case RAIDZ:
-				vdev_raidz_map_alloc(&zio, vdev->ashift,
-				    vdev->count, vdev->nparity, vdev->names,
-				    actual_size);
-				break;
-			default:
-				break;
+				if (nnext == cap) {
+					cap = cap ? cap * 2 : 16;
+					next = realloc(
+					    next, cap * sizeof(zdb_gang_t *));
+				}
+				gn->child[g] = calloc(1, sizeof(zdb_gang_t));
+				gn->child[g]->bp = *gbp;
+				gn->child[g]->zb = gn->zb;
+				next[nnext++] = gn->child[g];
 			}
 		}
-	}
 
-	c2list_fin(&block_list, free);
+		free(round);
+		round = next;
+		n = nnext;
+	}
 
-	dmu_buf_rele(db, FTAG);
+	free(round);
+	if (err) {
+		fprintf(stderr, "Failed to read gang header: %s\n",
+		    strerror(err));
+	}
+	return (err);
 }
 
+/*
+ * Append to map the members of the gang block of gn, whose tree has been
+ * read, which hold the physical data of the L0 block whole from gang_offset
+ * on. The DVAs of a gang block point at a gang header listing the block
+ * pointers of its members, which may be gang blocks themselves.
+ */
 static void
-cleanup_zpool(vdti_t *zpool, int print, int clean)
+map_add_gang(const zdb_ctx_t *ctx, const zdb_gang_t *gn,
+    const libzdb_block_t *whole, uint64_t gang_offset, libzdb_map_t *map)
 {
-	if (print) {
-		printf("%s\n", zpool->name);
-	}
-
-	size_t vdev_index = 0;
-	node_t *vdev_node = c2list_head(&zpool->vdevs);
-	while (vdev_node) {
-		vdi_t *vdev = c2list_get(vdev_node);
-
-		if (print) {
-			printf("    vdev %zu, ashift %zu, "
-			       "count %zu, ",
-			    vdev_index, vdev->ashift, vdev->names.count);
-
-			switch (vdev->type) {
-			case STRIPE:
-				printf("stripe");
-				break;
-			case RAIDZ:
-				printf("raidz %zu", vdev->nparity);
-				break;
-			case MIRROR:
-				printf("mirror");
-				break;
-			default:
-				printf("unknown");
-				break;
-			}
+	const zio_gbh_phys_t *gbh = abd_to_buf(gn->abd);
 
-			printf("\n");
-		}
+	for (int g = 0; g < SPA_GBH_NBLKPTRS; g++) {
+		const blkptr_t *gbp = &gbh->zg_blkptr[g];
 
-		size_t dev_index = 0;
-		node_t *dev_node = c2list_head(&vdev->names);
-		while (dev_node) {
-			char *name = c2list_get(dev_node);
-			if (print) {
-				printf("        dev "
-				       "%zu %s\n",
-				    dev_index, name);
-			}
-			dev_node = c2list_next(dev_node);
-			dev_index++;
+		if (BP_IS_HOLE(gbp)) {
+			continue;
 		}
-
-		if (clean) {
-			c2list_fin(&vdev->names, NULL);
+		if (BP_IS_GANG(gbp)) {
+			map_add_gang(
+			    ctx, gn->child[g], whole, gang_offset, map);
+			gang_offset += BP_GET_PSIZE(gbp);
+			continue;
 		}
 
-		vdev_node = c2list_next(vdev_node);
-		vdev_index++;
-	}
-
-	if (clean) {
-		c2list_fin(&zpool->vdevs, free);
+		libzdb_block_t *info = map_add_block(map);
+		*info = *whole;
+		info->flags |= LIBZDB_BLOCK_GANG;
+		info->gang_offset = gang_offset;
+		info->gang_size = BP_GET_PSIZE(gbp);
+		info->ndvas = BP_GET_NDVAS(gbp);
+		/* each member has a checksum of its own data */
+		block_set_checksum(info, gbp);
+		block_set_dvas(info, gbp, ctx->copies, map->nblocks - 1);
+		gang_offset += info->gang_size;
 	}
-
-	free(zpool);
 }
 
-static zpool_vdevs_t *
-dump_cachefile(const char *cachefile, const char *zpool_name)
+/*
+ * Add the block of bp to map if it is a L0 block. gang is the gang tree of
+ * bp if it is a gang block, read by gang_read_children().
+ */
+static void
+print_indirect(const zdb_ctx_t *ctx, blkptr_t *bp, const zbookmark_phys_t *zb,
+    const dnode_phys_t *dnp, const zdb_gang_t *gang, libzdb_map_t *map)
 {
-	int fd;
-	struct stat64 statbuf;
-	char *buf;
-	nvlist_t *config;
-
-	if ((fd = open64(cachefile, O_RDONLY)) < 0) {
-		(void) printf(
-		    "cannot open '%s': %s\n", cachefile, strerror(errno));
-		exit(1);
+	if (!BP_IS_EMBEDDED(bp)) {
+		ASSERT3U(BP_GET_TYPE(bp), ==, dnp->dn_type);
+		ASSERT3U(BP_GET_LEVEL(bp), ==, zb->zb_level);
 	}
 
-	if (fstat64(fd, &statbuf) != 0) {
-		(void) printf(
-		    "failed to stat '%s': %s\n", cachefile, strerror(errno));
-		exit(1);
+	/* only L0 blocks are kept, and they are written in place */
+	libzdb_block_t indirect;
+	libzdb_block_t *info =
+	    BP_GET_LEVEL(bp) == 0 ? map_add_block(map) : &indirect;
+	block_from_bp(bp, info);
+	if (BP_GET_LEVEL(bp) == 0) {
+		info->file_offset = blkid2offset(dnp, bp, zb);
 	}
-
-	if ((buf = malloc(statbuf.st_size)) == NULL) {
-		(void) fprintf(stderr, "failed to allocate %llu bytes\n",
-		    (u_longlong_t) statbuf.st_size);
-		exit(1);
+	if (BP_GET_LEVEL(bp) == 0 && !BP_IS_EMBEDDED(bp) && !BP_IS_HOLE(bp) &&
+	    !BP_IS_GANG(bp)) {
+		block_set_dvas(info, bp, ctx->copies, map->nblocks - 1);
 	}
-
-	if (read(fd, buf, statbuf.st_size) != statbuf.st_size) {
-		(void) fprintf(stderr, "failed to read %llu bytes\n",
-		    (u_longlong_t) statbuf.st_size);
-		exit(1);
+	if (BP_GET_LEVEL(bp) == 0 && (info->flags & LIBZDB_BLOCK_EMBEDDED)) {
+		info->offset = map_add_embedded(map, info->physical_file_data);
+		decode_embedded_bp_compressed(bp, map->embedded + info->offset);
 	}
 
-	(void) close(fd);
+	/* the DVAs of a gang block locate its header, not file data */
+	if (BP_GET_LEVEL(bp) == 0 && !BP_IS_EMBEDDED(bp) && BP_IS_GANG(bp)) {
+		const libzdb_block_t whole = *info;
 
-	if (nvlist_unpack(buf, statbuf.st_size, &config, 0) != 0) {
-		(void) fprintf(stderr, "failed to unpack nvlist\n");
-		exit(1);
+		VERIFY3P(gang, !=, NULL);
+		map->nblocks--;
+		map_add_gang(ctx, gang, &whole, 0, map);
 	}
+}
 
-	free(buf);
-
-	/* generate list of vdev names here, before nvlist_free */
+/*
+ * Whether the subtree of bp is the same as when the map being updated was
+ * made. Any change below a block pointer gives it a new birth txg, whereas
+ * holes may have no birth txg at all, so they always count as changed.
+ */
+static boolean_t
+bp_unchanged(const zdb_ctx_t *ctx, const blkptr_t *bp)
+{
+	return (ctx->prev != NULL && !BP_IS_HOLE(bp) &&
+	    bp->blk_birth <= ctx->prev->txg);
+}
 
-	vdti_t *zpool = NULL;
+/*
+ * Start an asynchronous read of an indirect block into the ARC so that a
+ * later blocking arc_read() of the same block finds it cached or in flight.
+ * Similar to traverse_prefetch_metadata().
+ */
+static void
+prefetch_indirect(const zdb_ctx_t *ctx, spa_t *spa, const blkptr_t *bp,
+    const zbookmark_phys_t *zb)
+{
+	arc_flags_t flags = ARC_FLAG_NOWAIT | ARC_FLAG_PREFETCH;
 
-	c2_dump_nvlist(config, 0, zpool_name, &zpool, NULL);
+	if (bp->blk_birth == 0 || BP_IS_HOLE(bp) || BP_IS_EMBEDDED(bp) ||
+	    BP_GET_LEVEL(bp) == 0 || bp_unchanged(ctx, bp))
+		return;
 
-	zpool_vdevs_t *vdevs = malloc(sizeof(zpool_vdevs_t));
-	vdevs->count = zpool->vdevs.count;
-	vdevs->vdevs = malloc(sizeof(zpool_vdev_t) * vdevs->count);
+	(void) arc_read(NULL, spa, bp, NULL, NULL, ZIO_PRIORITY_ASYNC_READ,
+	    ZIO_FLAG_CANFAIL | ZIO_FLAG_SPECULATIVE, &flags, zb);
+}
 
-	/* copy info from each vdev within the current zpool */
-	size_t vdevidx = 0;
-	for (node_t *zpool_vdev_node = c2list_head(&zpool->vdevs);
-	     zpool_vdev_node; zpool_vdev_node = c2list_next(zpool_vdev_node)) {
-		vdi_t *zpool_vdev = c2list_get(zpool_vdev_node);
+/* Number of file bytes covered by a block pointer at the given level */
+static uint64_t
+blkid_span(const dnode_phys_t *dnp, int64_t level)
+{
+	const uint64_t shift =
+	    level * (dnp->dn_indblkshift - SPA_BLKPTRSHIFT);
+	const uint64_t dblksz = (uint64_t) dnp->dn_datablkszsec
+	    << SPA_MINBLOCKSHIFT;
 
-		/* set up current vdev */
-		zpool_vdev_t *vdev = &vdevs->vdevs[vdevidx];
-		vdev->type = zpool_vdev->type;
-		vdev->count = zpool_vdev->names.count;
-		vdev->names = malloc(sizeof(char *) * vdev->count);
-		vdev->nparity = zpool_vdev->nparity;
-		vdev->ashift = zpool_vdev->ashift;
+	if (shift >= 64 || dblksz > (UINT64_MAX >> shift))
+		return (UINT64_MAX);
 
-		/* explicitly copy vdev backing device names from nvpair
-		 * tree */
-		size_t devidx = 0;
-		for (node_t *node = c2list_head(&zpool_vdev->names); node;
-		     node = c2list_next(node)) {
-			const char *path = c2list_get(node);
-			const size_t path_len = strlen(path);
-			const size_t path_size = (path_len + 1) * sizeof(char);
+	return (dblksz << shift);
+}
 
-			vdev->names[devidx] = malloc(path_size);
-			snprintf(vdev->names[devidx], path_size, "%s", path);
+/*
+ * Narrow [*first, *last], a run of blkids at the given level, to the block
+ * pointers that cover part of the byte range requested by ctx. The run is
+ * empty on return if *first > *last.
+ */
+static void
+range_blkids(const zdb_ctx_t *ctx, const dnode_phys_t *dnp, int64_t level,
+    uint64_t *first, uint64_t *last)
+{
+	const uint64_t span = blkid_span(dnp, level);
 
-			devidx++;
-		}
+	*first = MAX(*first, ctx->range_start / span);
+	*last = MIN(*last, (ctx->range_end - 1) / span);
+}
 
-		vdevidx++;
+/* Record the file range of the block pointer at zb as changed */
+static void
+mark_changed(const zdb_ctx_t *ctx, const dnode_phys_t *dnp,
+    const zbookmark_phys_t *zb)
+{
+	zdb_changes_t *changes = ctx->changes;
+	zdb_range_t *last =
+	    changes->count ? &changes->ranges[changes->count - 1] : NULL;
+	const uint64_t span = blkid_span(dnp, zb->zb_level);
+	const uint64_t start =
+	    zb->zb_blkid > UINT64_MAX / span ? UINT64_MAX : zb->zb_blkid * span;
+	const uint64_t end = start > UINT64_MAX - span ? UINT64_MAX
+						       : start + span;
+
+	/* the walk is in file order, so only the last range can be extended */
+	if (last && last->end == start) {
+		last->end = end;
+		return;
 	}
 
-	cleanup_zpool(zpool, 0, 1);
+	if (changes->count == changes->cap) {
+		changes->cap = changes->cap ? changes->cap * 2 : 16;
+		changes->ranges = realloc(
+		    changes->ranges, changes->cap * sizeof(zdb_range_t));
+	}
+	changes->ranges[changes->count].start = start;
+	changes->ranges[changes->count].end = end;
+	changes->count++;
+}
 
-	nvlist_free(config);
+/*
+ * Read the gang trees of the gang blocks among the count L0 block pointers
+ * bps that the walk maps, bps[0] being at bookmark zb, all at once rather
+ * than one header at a time. On success *gangsp is NULL if there are none,
+ * or holds the tree of each of bps, NULL for the others.
+ */
+static int
+gang_read_children(const zdb_ctx_t *ctx, spa_t *spa, const blkptr_t *bps,
+    size_t count, const zbookmark_phys_t *zb, zdb_gang_t ***gangsp)
+{
+	zdb_gang_t **gangs = NULL;
+	int err;
+
+	*gangsp = NULL;
+	for (size_t i = 0; i < count; i++) {
+		const blkptr_t *bp = &bps[i];
+
+		/* as visit_indirect() skips them */
+		if (bp->blk_birth == 0 || bp_unchanged(ctx, bp) ||
+		    BP_IS_HOLE(bp) || !BP_IS_GANG(bp)) {
+			continue;
+		}
+		if (gangs == NULL) {
+			gangs = calloc(count, sizeof(zdb_gang_t *));
+		}
+		gangs[i] = calloc(1, sizeof(zdb_gang_t));
+		gangs[i]->bp = *bp;
+		SET_BOOKMARK(&gangs[i]->zb, zb->zb_objset, zb->zb_object, 0,
+		    zb->zb_blkid + i);
+	}
+	if (gangs == NULL) {
+		return (0);
+	}
+
+	err = gang_read(spa, gangs, count);
+	if (err) {
+		gangs_free(gangs, count);
+		return (err);
+	}
+
+	*gangsp = gangs;
+	return (0);
+}
+
+static int
+visit_indirect(const zdb_ctx_t *ctx, spa_t *spa, const dnode_phys_t *dnp,
+    blkptr_t *bp, const zbookmark_phys_t *zb, const zdb_gang_t *gang,
+    libzdb_map_t *map)
+{
+	const uint32_t prefetch = ctx->session->prefetch;
+	int err = 0;
+
+	if (ctx->prev) {
+		if (bp_unchanged(ctx, bp))
+			return (0);
+		/* changed indirect blocks are narrowed down by children */
+		if (zb->zb_level == 0 || BP_IS_HOLE(bp))
+			mark_changed(ctx, dnp, zb);
+	}
+
+	if (bp->blk_birth == 0)
+		return (0);
+
+	print_indirect(ctx, bp, zb, dnp, gang, map);
+
+	if (BP_GET_LEVEL(bp) > 0 && !BP_IS_HOLE(bp)) {
+		arc_flags_t flags = ARC_FLAG_WAIT;
+		int i;
+		int pf;
+		blkptr_t *cbp;
+		int epb = BP_GET_LSIZE(bp) >> SPA_BLKPTRSHIFT;
+		arc_buf_t *buf;
+		uint64_t fill = 0;
+		uint64_t first = zb->zb_blkid * epb;
+		uint64_t last = first + epb - 1;
+
+		/* skip children wholly outside of the requested range */
+		range_blkids(ctx, dnp, zb->zb_level - 1, &first, &last);
+		if (first > last)
+			return (0);
+
+		err = arc_read(NULL, spa, bp, arc_getbuf_func, &buf,
+		    ZIO_PRIORITY_ASYNC_READ, ZIO_FLAG_CANFAIL, &flags, zb);
+		if (err)
+			return (err);
+		ASSERT(buf->b_data);
+
+		/* recursively visit blocks below this */
+		i = first - zb->zb_blkid * epb;
+		pf = i;
+		cbp = (blkptr_t *) buf->b_data + i;
+
+		/* the gang headers of all L0 children are read at once */
+		zdb_gang_t **gangs = NULL;
+		if (BP_GET_LEVEL(bp) == 1) {
+			zbookmark_phys_t fzb;
+
+			SET_BOOKMARK(&fzb, zb->zb_objset, zb->zb_object, 0,
+			    first);
+			err = gang_read_children(
+			    ctx, spa, cbp, last - first + 1, &fzb, &gangs);
+			if (err) {
+				arc_buf_destroy(buf, &buf);
+				return (err);
+			}
+		}
+
+		for (; i <= last - zb->zb_blkid * epb; i++, cbp++) {
+			zbookmark_phys_t czb;
+
+			/*
+			 * Keep the reads of up to prefetch child indirect
+			 * blocks in flight ahead of the depth first walk.
+			 * Level 1 children point at file data, which is never
+			 * read.
+			 */
+			if (prefetch && BP_GET_LEVEL(bp) > 1) {
+				for (; pf <= last - zb->zb_blkid * epb &&
+				     pf <= i + prefetch;
+				     pf++) {
+					SET_BOOKMARK(&czb, zb->zb_objset,
+					    zb->zb_object, zb->zb_level - 1,
+					    zb->zb_blkid * epb + pf);
+					blkptr_t *pbp =
+					    (blkptr_t *) buf->b_data + pf;
+					prefetch_indirect(ctx, spa, pbp, &czb);
+				}
+			}
+
+			SET_BOOKMARK(&czb, zb->zb_objset, zb->zb_object,
+			    zb->zb_level - 1, zb->zb_blkid * epb + i);
+			err = visit_indirect(ctx, spa, dnp, cbp, &czb,
+			    gangs ? gangs[czb.zb_blkid - first] : NULL, map);
+			if (err)
+				break;
+			fill += BP_GET_FILL(cbp);
+		}
+		if (!err && last - first + 1 == epb)
+			ASSERT3U(fill, ==, BP_GET_FILL(bp));
+		gangs_free(gangs, last - first + 1);
+		arc_buf_destroy(buf, &buf);
+	}
+
+	return (err);
+}
+
+static int
+dump_indirect(const zdb_ctx_t *ctx, dnode_t *dn, libzdb_map_t *map)
+{
+	dnode_phys_t *dnp = dn->dn_phys;
+	spa_t *spa = dmu_objset_spa(dn->dn_objset);
+	uint64_t j;
+	uint64_t first = 0;
+	uint64_t last = dnp->dn_nblkptr - 1;
+	zbookmark_phys_t czb;
+	int err = 0;
+
+	range_blkids(ctx, dnp, dnp->dn_nlevels - 1, &first, &last);
+
+	SET_BOOKMARK(&czb, dmu_objset_id(dn->dn_objset), dn->dn_object,
+	    dnp->dn_nlevels - 1, 0);
+	if (ctx->session->prefetch) {
+		for (j = first; j <= last && first <= last; j++) {
+			czb.zb_blkid = j;
+			prefetch_indirect(
+			    ctx, spa, &dnp->dn_blkptr[j], &czb);
+		}
+	}
+
+	/* the block pointers of the dnode of a small file are L0 ones */
+	zdb_gang_t **gangs = NULL;
+	if (dnp->dn_nlevels == 1 && first <= last) {
+		czb.zb_blkid = first;
+		err = gang_read_children(ctx, spa, &dnp->dn_blkptr[first],
+		    last - first + 1, &czb, &gangs);
+	}
+
+	for (j = first; j <= last && first <= last && !err; j++) {
+		czb.zb_blkid = j;
+		err = visit_indirect(ctx, spa, dnp, &dnp->dn_blkptr[j], &czb,
+		    gangs ? gangs[j - first] : NULL, map);
+	}
+	gangs_free(gangs, last - first + 1);
+
+	/* printf ("\n"); */
+
+	return (err);
+}
+
+/* Sets *fsize and *gen to the size and znode generation of a file */
+static int
+dump_znode(zdb_dataset_t *ds, uint64_t object, void *data, size_t size,
+    uint64_t *fsize, uint64_t *gen)
+{
+	objset_t *os = ds->os;
+	sa_attr_type_t *sa_attr_table = ds->sa_attr_table;
+	sa_handle_t *hdl;
+	sa_bulk_attr_t bulk[2];
+	int idx = 0;
+	int err;
+
+	err = sa_handle_get(os, object, NULL, SA_HDL_PRIVATE, &hdl);
+	if (err) {
+		fprintf(stderr, "failed to get SA handle for obj %llu: %s\n",
+		    (u_longlong_t) object, strerror(err));
+		return (err);
+	}
+
+	SA_ADD_BULK_ATTR(bulk, idx, sa_attr_table[ZPL_SIZE], NULL, fsize, 8);
+	SA_ADD_BULK_ATTR(bulk, idx, sa_attr_table[ZPL_GEN], NULL, gen, 8);
+	err = sa_bulk_lookup(hdl, bulk, idx);
+	if (err) {
+		fprintf(stderr, "failed to look up size of obj %llu: %s\n",
+		    (u_longlong_t) object, strerror(err));
+	}
+
+	sa_handle_destroy(hdl);
+	return (err);
+}
+
+/* Append an extent to map and return it */
+static libzdb_extent_t *
+map_add_extent(libzdb_map_t *map)
+{
+	if (map->nextents == map->extents_cap) {
+		map->extents_cap = map->extents_cap ? map->extents_cap * 2 : 16;
+		map->extents = realloc(
+		    map->extents, map->extents_cap * sizeof(libzdb_extent_t));
+	}
+
+	return (&map->extents[map->nextents++]);
+}
+
+/*
+ * Append an extent of block info, the block of map at index block, on a
+ * child of vdev to out. The file offset of an extent of a compressed block
+ * is that of the block plus the position of the extent within its
+ * compressed data.
+ */
+static void
+map_push_extent(libzdb_map_t *out, const libzdb_block_t *info, size_t block,
+    const zpool_vdev_t *vdev, uint64_t child, uint64_t col, uint32_t flags,
+    uint64_t file_offset, uint64_t dev_offset, uint64_t length)
+{
+	libzdb_extent_t *ext = map_add_extent(out);
+	ext->file_offset = file_offset;
+	ext->dev_offset = dev_offset;
+	ext->length = length;
+	ext->dev = vdev->dev_base + child;
+	ext->flags = flags;
+	if (vdev->type == RAIDZ) {
+		ext->flags |= LIBZDB_EXTENT_RAIDZ;
+	}
+	if (block_compressed(info)) {
+		ext->flags |= LIBZDB_EXTENT_COMPRESSED;
+	}
+	/* the checksum can only be verified if the block is read whole */
+	if ((info->flags & LIBZDB_BLOCK_CHECKSUM) &&
+	    info->actual_size == block_psize(info)) {
+		ext->flags |= LIBZDB_EXTENT_CHECKSUM;
+	}
+	ext->block = block;
+	ext->child = child;
+	ext->col = col;
+}
+
+/* Append the extent of the payload of embedded block info to out */
+static void
+map_push_embedded(libzdb_map_t *out, const libzdb_block_t *info, size_t block)
+{
+	libzdb_extent_t *ext = map_add_extent(out);
+	memset(ext, 0, sizeof(libzdb_extent_t));
+	ext->file_offset = info->file_offset;
+	ext->dev_offset = info->offset;
+	ext->length = info->actual_size;
+	ext->flags = LIBZDB_EXTENT_EMBEDDED;
+	if (block_compressed(info)) {
+		ext->flags |= LIBZDB_EXTENT_COMPRESSED;
+	}
+	ext->block = block;
+}
+
+/*
+ * Name of the extent map cache entry of a file. The znode generation tells
+ * a file apart from an earlier one that had the same object number.
+ */
+static void
+cache_path(const zdb_ctx_t *ctx, const libzdb_map_t *map, objset_t *os,
+    uint64_t gen, char *buf, size_t buflen)
+{
+	snprintf(buf, buflen, "%s/%016llx-%llu-%llu-%llu",
+	    ctx->session->cachedir, (u_longlong_t) map->pool_guid,
+	    (u_longlong_t) dmu_objset_id(os), (u_longlong_t) map->object,
+	    (u_longlong_t) gen);
+}
+
+/*
+ * Read the cache entry of the file of map, whose pool GUID, object and
+ * device table have been set, into its txg, file size, extents and embedded
+ * payloads. Returns 0 on success.
+ */
+static int
+cache_load(const char *path, libzdb_map_t *map)
+{
+	FILE *fp;
+	int err;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		return (ENOENT);
+	}
+	err = mapio_read(fp, map);
+	fclose(fp);
+	return (err);
+}
+
+/*
+ * Write the cache entry of a complete map. The entry is written to a
+ * temporary file that is then renamed, so that concurrent readers and
+ * writers of the same entry never see a partial one.
+ */
+static void
+cache_store(const char *path, const libzdb_map_t *map)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= sizeof(tmp) ||
+	    (fd = mkstemp(tmp)) == -1) {
+		fprintf(stderr, "cannot create cache entry '%s': %s\n", path,
+		    strerror(errno));
+		return;
+	}
+
+	fp = fdopen(fd, "w");
+	mapio_write(map, fp);
+	if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+		fprintf(stderr, "cannot write cache entry '%s': %s\n", path,
+		    strerror(errno));
+		unlink(tmp);
+	}
+}
+
+/* Number of raidz blocks laid out per vdev_raidz_map_batch() call */
+#define RAIDZ_BATCH 256
+
+/* Arguments of vdev_raidz_map_batch() for up to RAIDZ_BATCH blocks */
+typedef struct raidz_batch {
+	uint64_t *io_offset;
+	uint64_t *io_size;
+	uint64_t *actual_size;
+	uint32_t *ncols;
+	/* columns, RAIDZ_BATCH times the most data columns of a vdev */
+	uint32_t *devidx;
+	uint64_t *offset;
+	uint64_t *size;
+} raidz_batch_t;
+
+static void
+raidz_batch_alloc(
+    c2arena_t *arena, const zpool_vdevs_t *vdevs, raidz_batch_t *batch)
+{
+	size_t ndata = 0;
+
+	for (size_t v = 0; v < vdevs->count; v++) {
+		const zpool_vdev_t *vdev = &vdevs->vdevs[v];
+		if (vdev->type == RAIDZ) {
+			ndata = MAX(ndata, vdev->count - vdev->nparity);
+		}
+	}
+
+	batch->io_offset = c2arena_alloc(arena, RAIDZ_BATCH * sizeof(uint64_t));
+	batch->io_size = c2arena_alloc(arena, RAIDZ_BATCH * sizeof(uint64_t));
+	batch->actual_size =
+	    c2arena_alloc(arena, RAIDZ_BATCH * sizeof(uint64_t));
+	batch->ncols = c2arena_alloc(arena, RAIDZ_BATCH * sizeof(uint32_t));
+	batch->devidx =
+	    c2arena_alloc(arena, RAIDZ_BATCH * ndata * sizeof(uint32_t));
+	batch->offset =
+	    c2arena_alloc(arena, RAIDZ_BATCH * ndata * sizeof(uint64_t));
+	batch->size =
+	    c2arena_alloc(arena, RAIDZ_BATCH * ndata * sizeof(uint64_t));
+}
+
+/*
+ * Push to out the extents of the data columns of the run of up to
+ * RAIDZ_BATCH copies of blocks of map, starting at copy first, that are on
+ * the same raidz vdev. copies holds the copies, NULL for the first copy of
+ * every block. Returns the index of the copy following the run.
+ */
+static size_t
+map_raidz_run(const libzdb_map_t *map, const zdb_copies_t *copies,
+    const zpool_vdevs_t *vdevs, raidz_batch_t *batch, size_t first,
+    libzdb_map_t *out)
+{
+	const size_t count = copies ? copies->count : map->nblocks;
+	const uint32_t v = copy_at(map, copies, first).vdev;
+	const zpool_vdev_t *vdev = &vdevs->vdevs[v];
+	const size_t ndata = vdev->count - vdev->nparity;
+	const uint32_t flags = copies ? LIBZDB_EXTENT_COPY : 0;
+	size_t end = first;
+	size_t n = 0;
+
+	for (; end < count && n < RAIDZ_BATCH; end++, n++) {
+		const zdb_copy_t copy = copy_at(map, copies, end);
+		const libzdb_block_t *info = &map->blocks[copy.block];
+
+		if ((info->flags & LIBZDB_BLOCK_EMBEDDED) || copy.vdev != v) {
+			break;
+		}
+		batch->io_offset[n] = copy.offset;
+		/* gang members are only multiples of the minimum block size */
+		batch->io_size[n] =
+		    P2ROUNDUP(block_psize(info), 1ULL << vdev->geom.ashift);
+		batch->actual_size[n] = info->actual_size;
+	}
+
+	vdev_raidz_map_batch(&vdev->geom, n, batch->io_offset, batch->io_size,
+	    batch->actual_size, batch->ncols, batch->devidx, batch->offset,
+	    batch->size);
+
+	/* data columns hold each block in order */
+	for (size_t i = 0; i < n; i++) {
+		const uint32_t b = copy_at(map, copies, first + i).block;
+		const libzdb_block_t *info = &map->blocks[b];
+		uint64_t file_offset = info->file_offset + info->gang_offset;
+
+		for (size_t k = 0; k < batch->ncols[i]; k++) {
+			const size_t j = i * ndata + k;
+
+			map_push_extent(out, info, b, vdev,
+			    batch->devidx[j], vdev->nparity + k, flags,
+			    file_offset,
+			    batch->offset[j] + VDEV_LABEL_START_SIZE,
+			    batch->size[j]);
+			file_offset += batch->size[j];
+		}
+	}
+
+	return (end);
+}
+
+/*
+ * Whether prev maps the same file as map, on the same devices in the same
+ * states
+ */
+static boolean_t
+prev_matches(const libzdb_map_t *prev, const libzdb_map_t *map)
+{
+	if (prev->pool_guid != map->pool_guid || prev->object != map->object ||
+	    prev->gen != map->gen || strcmp(prev->dataset, map->dataset) != 0 ||
+	    prev->ndevs != map->ndevs || prev->dev_health != map->dev_health) {
+		return (B_FALSE);
+	}
+
+	for (size_t i = 0; i < map->ndevs; i++) {
+		if (prev->dev_vdevs[i] != map->dev_vdevs[i] ||
+		    strcmp(prev->devs[i], map->devs[i]) != 0) {
+			return (B_FALSE);
+		}
+	}
+
+	return (B_TRUE);
+}
+
+static int
+extent_cmp(const void *a, const void *b)
+{
+	const libzdb_extent_t *x = a;
+	const libzdb_extent_t *y = b;
+	const uint32_t xcopy = x->flags & LIBZDB_EXTENT_COPY;
+	const uint32_t ycopy = y->flags & LIBZDB_EXTENT_COPY;
+
+	if (x->file_offset != y->file_offset) {
+		return (x->file_offset < y->file_offset ? -1 : 1);
+	}
+	if (xcopy != ycopy) {
+		return (xcopy < ycopy ? -1 : 1);
+	}
+	/* devices are numbered by vdev, then by child */
+	if (x->dev != y->dev) {
+		return (x->dev < y->dev ? -1 : 1);
+	}
+	return (0);
+}
+
+/* Put the extents of map back in file order if they are not */
+static void
+map_sort_extents(libzdb_map_t *map)
+{
+	for (size_t i = 1; i < map->nextents; i++) {
+		if (map->extents[i].file_offset <
+		    map->extents[i - 1].file_offset) {
+			qsort(map->extents, map->nextents,
+			    sizeof(libzdb_extent_t), extent_cmp);
+			return;
+		}
+	}
+}
+
+/* Index of the first of the changed ranges that ends after offset */
+static size_t
+changes_find(const zdb_changes_t *changes, uint64_t offset)
+{
+	size_t lo = 0;
+	size_t hi = changes->count;
+
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (changes->ranges[mid].end <= offset) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return (lo);
+}
+
+/*
+ * Merge the blocks of map, the first base ones, with those of prev that
+ * extents of map refer to as base plus their index in prev, in file order.
+ * Every extent then refers to its block in the merged blocks.
+ */
+static void
+map_splice_blocks(libzdb_map_t *map, const libzdb_map_t *prev, size_t base)
+{
+	libzdb_block_t *fresh = map->blocks;
+	/* the merged index of every block, UINT32_MAX if no extent uses it */
+	uint32_t *index = malloc((base + prev->nblocks) * sizeof(uint32_t));
+	size_t kept = 0;
+	size_t f = 0;
+	size_t p = 0;
+
+	for (size_t b = base; b < base + prev->nblocks; b++) {
+		index[b] = UINT32_MAX;
+	}
+	for (size_t i = 0; i < map->nextents; i++) {
+		const uint32_t b = map->extents[i].block;
+		if (b >= base && index[b] == UINT32_MAX) {
+			index[b] = 0;
+			kept++;
+		}
+	}
+
+	map->blocks = NULL;
+	map->nblocks = 0;
+	map->blocks_cap = 0;
+	map_reserve_blocks(map, base + kept);
+
+	for (;;) {
+		while (p < prev->nblocks && index[base + p] == UINT32_MAX) {
+			p++;
+		}
+		if (f == base && p == prev->nblocks) {
+			break;
+		}
+		if (p == prev->nblocks || (f < base &&
+		    fresh[f].file_offset <= prev->blocks[p].file_offset)) {
+			index[f] = map->nblocks;
+			map->blocks[map->nblocks++] = fresh[f++];
+		} else {
+			index[base + p] = map->nblocks;
+			map->blocks[map->nblocks++] = prev->blocks[p++];
+		}
+	}
+
+	for (size_t i = 0; i < map->nextents; i++) {
+		map->extents[i].block = index[map->extents[i].block];
+	}
+
+	free(index);
+	free(fresh);
+}
+
+/*
+ * Replace the extents of map, those of the blocks that changed since prev
+ * was made, with the extents of both maps in file order: the changed ones,
+ * and the pieces of those of prev that lie outside of the changed ranges
+ * and within the file. An extent maps a file range linearly onto its device
+ * so it can be cut anywhere. The blocks of the pieces join those of map.
+ */
+static void
+map_splice(libzdb_map_t *map, const libzdb_map_t *prev,
+    const zdb_changes_t *changes)
+{
+	libzdb_extent_t *fresh = map->extents;
+	const size_t nfresh = map->nextents;
+	const size_t base = map->nblocks;
+	size_t f = 0;
+
+	map->extents = NULL;
+	map->nextents = 0;
+	map->extents_cap = 0;
+
+	for (size_t i = 0; i < prev->nextents; i++) {
+		const libzdb_extent_t *ext = &prev->extents[i];
+		uint64_t end =
+		    MIN(ext->file_offset + ext->length, map->file_size);
+		uint64_t start = ext->file_offset;
+
+		/* compressed data is kept whole, for blocks within the file */
+		if (ext->flags & LIBZDB_EXTENT_COMPRESSED) {
+			end = prev->blocks[ext->block].file_offset <
+				map->file_size
+			    ? ext->file_offset + ext->length
+			    : start;
+		}
+		/* the copies of joined extents overlap the extents after */
+		size_t r = changes_find(changes, start);
+
+		while (start < end) {
+			const zdb_range_t *range;
+			uint64_t piece_end = end;
+
+			while (r < changes->count &&
+			    changes->ranges[r].end <= start) {
+				r++;
+			}
+			if (r < changes->count) {
+				range = &changes->ranges[r];
+				if (range->start <= start) {
+					start = MIN(range->end, end);
+					continue;
+				}
+				piece_end = MIN(end, range->start);
+			}
+
+			while (f < nfresh && fresh[f].file_offset < start) {
+				*map_add_extent(map) = fresh[f++];
+			}
+
+			libzdb_extent_t *piece = map_add_extent(map);
+			*piece = *ext;
+			piece->file_offset = start;
+			piece->dev_offset += start - ext->file_offset;
+			piece->length = piece_end - start;
+			piece->block = base + ext->block;
+			if (ext->flags & LIBZDB_EXTENT_EMBEDDED) {
+				const uint64_t offset =
+				    map_add_embedded(map, piece->length);
+				memcpy(map->embedded + offset,
+				    prev->embedded + piece->dev_offset,
+				    piece->length);
+				piece->dev_offset = offset;
+			}
+
+			start = piece_end;
+		}
+	}
+
+	while (f < nfresh) {
+		*map_add_extent(map) = fresh[f++];
+	}
+
+	free(fresh);
+
+	map_splice_blocks(map, prev, base);
+
+	/*
+	 * A joined extent of prev may span blocks whose other copies were
+	 * not joined, and so start before the pieces that follow it.
+	 */
+	map_sort_extents(map);
+}
+
+/*
+ * Whether child c of a vdev can be read from: devices that are not healthy
+ * are left out, unless none of the vdev is
+ */
+static inline boolean_t
+dev_readable(const zpool_vdevs_t *vdevs, const zpool_vdev_t *vdev, size_t c)
+{
+	return (vdev->nhealthy == 0 ||
+	    vdevs->states[vdev->dev_base + c] == VDEV_STATE_HEALTHY);
+}
+
+/*
+ * Push to out the extents of a copy of the blocks of map: their first copy
+ * if copies is NULL, another one held by copies otherwise. Returns 0, or
+ * ENOTSUP if a copy with data to read is on a vdev that holds no data of
+ * its own, such as the indirect vdev of a removed device, so that no map
+ * leaves out part of a file.
+ */
+static int
+map_dva_extents(const zdb_ctx_t *ctx, const libzdb_map_t *map,
+    const zpool_vdevs_t *vdevs, const zdb_copies_t *copies,
+    raidz_batch_t *batch, libzdb_map_t *out)
+{
+	const uint32_t flags = copies ? LIBZDB_EXTENT_COPY : 0;
+	const size_t count = copies ? copies->count : map->nblocks;
+
+	for (size_t i = 0; i < count;) {
+		const zdb_copy_t copy = copy_at(map, copies, i);
+		const size_t b = copy.block;
+		const libzdb_block_t *info = &map->blocks[b];
+		const uint64_t actual_size = info->actual_size;
+
+		/* the payload of an embedded block is its only copy */
+		if (info->flags & LIBZDB_BLOCK_EMBEDDED) {
+			if (actual_size != 0) {
+				map_push_embedded(out, info, b);
+			}
+			i++;
+			continue;
+		}
+
+		const zpool_vdev_t *vdev = &vdevs->vdevs[copy.vdev];
+
+		if (vdev->type == HOLE && actual_size != 0) {
+			fprintf(stderr,
+			    "block at file offset %lu is on vdev %u, which "
+			    "holds no data\n",
+			    info->file_offset, copy.vdev);
+			return (ENOTSUP);
+		}
+		if (vdev->type == RAIDZ) {
+			if (!batch->io_offset) {
+				raidz_batch_alloc(ctx->arena, vdevs, batch);
+			}
+			i = map_raidz_run(map, copies, vdevs, batch, i, out);
+			continue;
+		}
+
+		if (actual_size != 0) {
+			switch (vdev->type) {
+			case STRIPE:
+				if (vdev->count != 1) {
+					fprintf(stderr,
+					    "Warning: Found multiple devices "
+					    "when only 1 is expected.\n");
+				}
+				map_push_extent(out, info, b, vdev, 0, 0, flags,
+				    info->file_offset + info->gang_offset,
+				    copy.offset + VDEV_LABEL_START_SIZE,
+				    actual_size);
+				break;
+			case MIRROR:
+				/* every readable child holds the whole block */
+				for (size_t c = 0, n = 0; c < vdev->count;
+				     c++) {
+					if (!dev_readable(vdevs, vdev, c)) {
+						continue;
+					}
+					const uint32_t cflags =
+					    n++ ? LIBZDB_EXTENT_COPY : flags;
+
+					map_push_extent(out, info, b, vdev,
+					    c, 0, cflags,
+					    info->file_offset +
+						info->gang_offset,
+					    copy.offset + VDEV_LABEL_START_SIZE,
+					    actual_size);
+				}
+				break;
+			default:
+				break;
+			}
+		}
+		i++;
+	}
+
+	return (0);
+}
+
+/* Release the copies kept while walking the blocks of a map */
+static void
+copies_free(zdb_copies_t *copies)
+{
+	for (size_t d = 0; d < LIBZDB_MAX_DVAS - 1; d++) {
+		free(copies[d].copies);
+	}
+}
+
+/*
+ * Merge extents, in file order, into the extents of map, also in file
+ * order. Those of map come first among extents at the same file offset.
+ * The merge runs from the end, in place, so that the extents of map are
+ * not held twice.
+ */
+static void
+map_merge_extents(
+    libzdb_map_t *map, const libzdb_extent_t *extents, size_t count)
+{
+	size_t i = map->nextents;
+	size_t j = count;
+
+	if (count == 0) {
+		return;
+	}
+
+	if (map->extents_cap - map->nextents < count) {
+		map->extents_cap = map->nextents + count;
+		map->extents = realloc(
+		    map->extents, map->extents_cap * sizeof(libzdb_extent_t));
+	}
+	map->nextents += count;
+
+	for (size_t k = map->nextents; j > 0;) {
+		libzdb_extent_t *last = i > 0 ? &map->extents[i - 1] : NULL;
+
+		if (last && last->file_offset > extents[j - 1].file_offset) {
+			map->extents[--k] = *last;
+			i--;
+		} else {
+			map->extents[--k] = extents[--j];
+		}
+	}
+}
+
+static int
+dump_object(zdb_ctx_t *ctx, zdb_dataset_t *ds, uint64_t object,
+    zpool_vdevs_t *vdevs, libzdb_map_t *map)
+{
+	objset_t *os = ds->os;
+	dmu_buf_t *db = NULL;
+	dmu_object_info_t doi;
+	dnode_t *dn = NULL;
+	void *bonus = NULL;
+	size_t bsize = 0;
+	int error;
+
+	error = dmu_object_info(os, object, &doi);
+	if (error) {
+		fprintf(stderr, "dmu_object_info() failed, errno %u\n", error);
+		return (error);
+	}
+
+	error = dmu_bonus_hold(os, object, FTAG, &db);
+	if (error) {
+		fprintf(stderr, "dmu_bonus_hold(%lu) failed, errno %u", object,
+		    error);
+		return (error);
+	}
+	bonus = db->db_data;
+	bsize = db->db_size;
+	dn = DB_DNODE((dmu_buf_impl_t *) db);
+
+	uint64_t fsize;
+	uint64_t gen;
+	error = dump_znode(ds, object, bonus, bsize, &fsize, &gen);
+	if (error) {
+		dmu_buf_rele(db, FTAG);
+		return (error);
+	}
+
+	map->pool_guid = spa_guid(dmu_objset_spa(os));
+	memcpy(map->cksum_salt, dmu_objset_spa(os)->spa_cksum_salt.zcs_bytes,
+	    sizeof(map->cksum_salt));
+	map->object = object;
+	map->gen = gen;
+	map->file_size = fsize;
+	map->devs = vdevs->devs;
+	map->dev_vdevs = vdevs->dev_vdevs;
+	map->dev_health = vdevs->health;
+	map->ndevs = vdevs->ndevs;
+	for (int j = 0; j < dn->dn_phys->dn_nblkptr; j++) {
+		map->txg = MAX(map->txg, dn->dn_phys->dn_blkptr[j].blk_birth);
+	}
+
+	/*
+	 * Only maps of whole files are cached. A cache entry is reused while
+	 * the highest birth txg of the top-level block pointers and the file
+	 * size are unchanged: any write to the file bumps the birth txg of
+	 * every block pointer on the path to the root. An outdated entry is
+	 * updated like a map passed to libzdb_remap(). Entries made while the
+	 * devices were in other states are not even loaded, since they may
+	 * leave out copies on devices that are readable again.
+	 */
+	char cpath[PATH_MAX];
+	libzdb_map_t entry = *map;
+	const int cached = ctx->session->cachedir && gen != 0 &&
+	    ctx->range_start == 0 && ctx->range_end == UINT64_MAX;
+	if (cached) {
+		cache_path(ctx, map, os, gen, cpath, sizeof(cpath));
+		if (cache_load(cpath, &entry) == 0) {
+			if (entry.txg == map->txg && entry.file_size == fsize) {
+				map->blocks = entry.blocks;
+				map->nblocks = entry.nblocks;
+				map->blocks_cap = entry.blocks_cap;
+				map->extents = entry.extents;
+				map->nextents = entry.nextents;
+				map->extents_cap = entry.extents_cap;
+				map->embedded = entry.embedded;
+				map->embedded_len = entry.embedded_len;
+				map->embedded_cap = entry.embedded_cap;
+				dmu_buf_rele(db, FTAG);
+				return (0);
+			}
+			if (!ctx->prev) {
+				ctx->prev = &entry;
+			}
+		}
+	}
+
+	/* a previous map of another file, or a reused object, is ignored */
+	if (ctx->prev && !prev_matches(ctx->prev, map)) {
+		ctx->prev = NULL;
+	}
+	zdb_changes_t changes = {NULL, 0, 0};
+	ctx->changes = &changes;
+	zdb_copies_t copies[LIBZDB_MAX_DVAS - 1];
+	memset(copies, 0, sizeof(copies));
+	ctx->copies = copies;
+
+	/*
+	 * Size the block vector up front for the L0 block pointers of the
+	 * requested range, but for no more than the non-hole blocks of the
+	 * file so that a sparse file reserves no memory for its holes. An
+	 * update only visits the blocks that changed.
+	 */
+	if (!ctx->prev) {
+		const dnode_phys_t *dnp = dn->dn_phys;
+		const uint64_t dblksz = blkid_span(dnp, 0);
+		const uint64_t first = ctx->range_start / dblksz;
+		const uint64_t last =
+		    MIN(dnp->dn_maxblkid, (ctx->range_end - 1) / dblksz);
+
+		if (first <= last) {
+			map_reserve_blocks(
+			    map, MIN(last - first + 1, doi.doi_fill_count));
+		}
+	}
+
+	/* a partial map, e.g. missing the members of a gang block, is wrong */
+	error = dump_indirect(ctx, dn, map);
+	/* extents refer to their block by a 32-bit index */
+	if (!error && map->nblocks > UINT32_MAX) {
+		fprintf(stderr, "object %llu has too many blocks to map\n",
+		    (u_longlong_t) object);
+		error = EFBIG;
+	}
+	if (error) {
+		free(changes.ranges);
+		copies_free(copies);
+		free(entry.blocks);
+		free(entry.extents);
+		free(entry.embedded);
+		dmu_buf_rele(db, FTAG);
+		return (error);
+	}
+
+	size_t next = 0;
+	for (size_t b = 0; b < map->nblocks; b++) {
+		libzdb_block_t *info = &map->blocks[b];
+		/* the members of a gang block share its file offset */
+		if (next <= b) {
+			for (next = b + 1; next < map->nblocks &&
+			     map->blocks[next].file_offset == info->file_offset;
+			     next++) {
+			}
+		}
+		/* the last block is bounded by the end of the file */
+		const uint64_t next_offset = next < map->nblocks
+		    ? map->blocks[next].file_offset
+		    : fsize;
+
+		/*
+		 * If a given block is a hole physical_file_data will be
+		 * zero and we skip the block. A compressed block is read
+		 * whole, since all of its physical data is needed to
+		 * decompress any of it. Otherwise, we bound the record
+		 * size to never exceed true file size. Note that
+		 * "next_offset - info->file_offset" can be greater than
+		 * the remaining file size when the next block happens to
+		 * be a hole. Yes, zfs may insert a hole even at the very
+		 * end of a file! The remaining file size is measured from
+		 * the block itself since only a range of the file may have
+		 * been visited. Logical file data may be greater than true
+		 * file size due to zfs-introduced padding within a block or
+		 * an ashift.
+		 */
+		const uint64_t remaining_fsize =
+		    fsize - MIN(fsize, info->file_offset);
+		const uint64_t actual_size = block_compressed(info)
+		    ? info->physical_file_data
+		    : MIN((MIN(next_offset - info->file_offset,
+			      info->physical_file_data)),
+			  remaining_fsize);
+
+		/* a gang member holds its part of what is read of the block */
+		if (info->flags & LIBZDB_BLOCK_GANG) {
+			info->actual_size = MIN(info->gang_size,
+			    actual_size - MIN(actual_size, info->gang_offset));
+		} else {
+			info->actual_size = actual_size;
+		}
+	}
+
+	/* raidz blocks are laid out a run of blocks at a time */
+	raidz_batch_t batch = {NULL};
+
+	error = map_dva_extents(ctx, map, vdevs, NULL, &batch, map);
+
+	/*
+	 * The other copies of blocks written more than once are alternative
+	 * sources of the same data.
+	 */
+	for (size_t d = 0; d < LIBZDB_MAX_DVAS - 1 && !error; d++) {
+		libzdb_map_t other;
+
+		memset(&other, 0, sizeof(other));
+		error = map_dva_extents(
+		    ctx, map, vdevs, &copies[d], &batch, &other);
+		if (!error) {
+			map_merge_extents(map, other.extents, other.nextents);
+		}
+		free(other.extents);
+	}
+	copies_free(copies);
+	ctx->copies = NULL;
+
+	/* as for dump_indirect(), a map missing part of the file is wrong */
+	if (error) {
+		free(changes.ranges);
+		free(entry.blocks);
+		free(entry.extents);
+		free(entry.embedded);
+		dmu_buf_rele(db, FTAG);
+		return (error);
+	}
+
+	if (ctx->prev) {
+		map_splice(map, ctx->prev, &changes);
+	}
+	free(changes.ranges);
+	free(entry.blocks);
+	free(entry.extents);
+	free(entry.embedded);
+
+	if (cached) {
+		cache_store(cpath, map);
+	}
+
+	dmu_buf_rele(db, FTAG);
+
+	return (0);
+}
+
+/* Allocate the topology of a pool of count vdevs and ndevs devices */
+static zpool_vdevs_t *
+vdevs_alloc(size_t count, size_t ndevs)
+{
+	/* the topology is freed all at once by cleanup_vdevs() */
+	zpool_vdevs_t *vdevs = malloc(sizeof(zpool_vdevs_t));
+	c2arena_init(&vdevs->arena, 4096);
+	vdevs->count = count;
+	vdevs->vdevs =
+	    c2arena_alloc(&vdevs->arena, sizeof(zpool_vdev_t) * count);
+	vdevs->ndevs = ndevs;
+	vdevs->devs = c2arena_alloc(&vdevs->arena, sizeof(char *) * ndevs);
+	vdevs->dev_vdevs =
+	    c2arena_alloc(&vdevs->arena, sizeof(uint32_t) * ndevs);
+	vdevs->states = c2arena_alloc(&vdevs->arena, sizeof(uint64_t) * ndevs);
+	vdevs->health = 0;
+	return (vdevs);
+}
+
+/* Set up vdev v of vdevs, whose devices start at dev_base */
+static zpool_vdev_t *
+vdevs_init_vdev(zpool_vdevs_t *vdevs, size_t v, zpool_type_t type,
+    size_t count, size_t nparity, size_t ashift, size_t dev_base)
+{
+	zpool_vdev_t *vdev = &vdevs->vdevs[v];
+	vdev->type = type;
+	vdev->count = count;
+	vdev->names = &vdevs->devs[dev_base];
+	vdev->dev_base = dev_base;
+	vdev->nparity = nparity;
+	vdev->ashift = ashift;
+	vdev->nhealthy = 0;
+	for (size_t c = 0; c < count; c++) {
+		vdevs->dev_vdevs[dev_base + c] = v;
+	}
+	if (vdev->type == RAIDZ) {
+		vdev_raidz_geom_init(
+		    &vdev->geom, vdev->ashift, vdev->count, vdev->nparity);
+	}
+	return (vdev);
+}
+
+/* How the data of a top-level vdev is laid out on its children */
+static zpool_type_t
+vdev_layout(const vdev_t *tvd)
+{
+	const char *type = tvd->vdev_ops->vdev_op_type;
+
+	if (strcmp(type, VDEV_TYPE_RAIDZ) == 0) {
+		return (RAIDZ);
+	}
+	if (strcmp(type, VDEV_TYPE_MIRROR) == 0) {
+		return (MIRROR);
+	}
+	/* holes, missing and removed vdevs hold no data of their own */
+	if (strcmp(type, VDEV_TYPE_HOLE) == 0 ||
+	    strcmp(type, VDEV_TYPE_MISSING) == 0 ||
+	    strcmp(type, VDEV_TYPE_INDIRECT) == 0) {
+		return (HOLE);
+	}
+	/* a single device, possibly being replaced */
+	return (STRIPE);
+}
+
+/* Number of devices a top-level vdev spreads its data over */
+static size_t
+vdev_ndevs(const vdev_t *tvd)
+{
+	switch (vdev_layout(tvd)) {
+	case RAIDZ:
+	case MIRROR:
+		return (tvd->vdev_children);
+	case STRIPE:
+		return (1);
+	default:
+		return (0);
+	}
+}
+
+/*
+ * The leaf vdev holding the data of vd. Replacing and spare vdevs hold the
+ * data on the device being replaced, their first child, while it is
+ * healthy. Otherwise another child only holds all of the data once it has
+ * been resilvered, i.e. its DTL_MISSING is empty; a child still being
+ * resilvered lacks the blocks written before it was attached.
+ */
+static const vdev_t *
+vdev_data_leaf(const vdev_t *vd)
+{
+	while (vd->vdev_children > 0) {
+		const vdev_t *cvd = vd->vdev_child[0];
+
+		for (uint64_t c = 1; c < vd->vdev_children &&
+		     cvd->vdev_state != VDEV_STATE_HEALTHY;
+		     c++) {
+			vdev_t *other = vd->vdev_child[c];
+
+			if (other->vdev_state == VDEV_STATE_HEALTHY &&
+			    vdev_dtl_empty(other, DTL_MISSING)) {
+				cvd = other;
+			}
+		}
+		vd = cvd;
+	}
+	return (vd);
+}
+
+/*
+ * Build the vdev topology of an imported pool from its vdev tree. Top-level
+ * vdevs are indexed by their vdev_id, the vdev of their DVAs, including
+ * holes and those of log and special allocation classes.
+ */
+static int
+load_vdevs(spa_t *spa, zpool_vdevs_t **vdevsp)
+{
+	spa_config_enter(spa, SCL_VDEV, FTAG, RW_READER);
+
+	const vdev_t *rvd = spa->spa_root_vdev;
+	size_t ndevs = 0;
+
+	for (uint64_t v = 0; v < rvd->vdev_children; v++) {
+		ndevs += vdev_ndevs(rvd->vdev_child[v]);
+	}
+
+	zpool_vdevs_t *vdevs = vdevs_alloc(rvd->vdev_children, ndevs);
+	size_t dev_base = 0;
+	for (uint64_t v = 0; v < rvd->vdev_children; v++) {
+		const vdev_t *tvd = rvd->vdev_child[v];
+		const zpool_type_t type = vdev_layout(tvd);
+		const size_t count = vdev_ndevs(tvd);
+
+		ASSERT3U(tvd->vdev_id, ==, v);
+		zpool_vdev_t *vdev = vdevs_init_vdev(vdevs, v, type, count,
+		    tvd->vdev_nparity, tvd->vdev_ashift, dev_base);
+
+		for (size_t c = 0; c < count; c++) {
+			const vdev_t *leaf = vdev_data_leaf(
+			    type == STRIPE ? tvd : tvd->vdev_child[c]);
+
+			/* missing leaves have no path */
+			vdev->names[c] = c2arena_strdup(&vdevs->arena,
+			    leaf->vdev_path ? leaf->vdev_path
+					    : leaf->vdev_ops->vdev_op_type);
+			vdevs->states[dev_base + c] = leaf->vdev_state;
+			if (leaf->vdev_state == VDEV_STATE_HEALTHY) {
+				vdev->nhealthy++;
+			}
+		}
+
+		dev_base += count;
+	}
+
+	/*
+	 * FNV-1a of the device states, which decide the copies a map lists,
+	 * so that maps made while a device was faulted are not reused once
+	 * it is back
+	 */
+	vdevs->health = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < ndevs; i++) {
+		vdevs->health ^= vdevs->states[i];
+		vdevs->health *= 0x100000001b3ULL;
+	}
+
+	spa_config_exit(spa, SCL_VDEV, FTAG);
+
+	*vdevsp = vdevs;
+	return (0);
+}
+
+static void
+cleanup_vdevs(zpool_vdevs_t *vdevs)
+{
+	c2arena_fin(&vdevs->arena);
+	free(vdevs);
+}
+
+#define DCACHE_MIN_BUCKETS 256
+
+static void
+dcache_init(zdb_dcache_t *dcache)
+{
+	rw_init(&dcache->lock, NULL, RW_DEFAULT, NULL);
+	dcache->nbuckets = DCACHE_MIN_BUCKETS;
+	dcache->buckets = calloc(dcache->nbuckets, sizeof(zdb_dentry_t *));
+	dcache->count = 0;
+	c2arena_init(&dcache->arena, 64 << 10);
+}
+
+static void
+dcache_fin(zdb_dcache_t *dcache)
+{
+	c2arena_fin(&dcache->arena);
+	free(dcache->buckets);
+	rw_destroy(&dcache->lock);
+}
+
+/* FNV-1a of the name, seeded with the parent object */
+static uint64_t
+dcache_hash(uint64_t parent, const char *name)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL ^ parent;
+
+	for (; *name; name++) {
+		hash ^= (uint8_t) *name;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return (hash);
+}
+
+/* Called with dcache->lock held */
+static zdb_dentry_t *
+dcache_find(zdb_dcache_t *dcache, uint64_t hash, uint64_t parent,
+    const char *name)
+{
+	zdb_dentry_t *dentry = dcache->buckets[hash & (dcache->nbuckets - 1)];
+
+	for (; dentry; dentry = dentry->next) {
+		if (dentry->hash == hash && dentry->parent == parent &&
+		    strcmp(dentry->name, name) == 0) {
+			return (dentry);
+		}
+	}
+
+	return (NULL);
+}
+
+static boolean_t
+dcache_lookup(zdb_dcache_t *dcache, uint64_t parent, const char *name,
+    uint64_t *child, dmu_object_type_t *type)
+{
+	const uint64_t hash = dcache_hash(parent, name);
+
+	rw_enter(&dcache->lock, RW_READER);
+	zdb_dentry_t *dentry = dcache_find(dcache, hash, parent, name);
+	if (dentry) {
+		*child = dentry->child;
+		*type = dentry->type;
+	}
+	rw_exit(&dcache->lock);
+
+	return (dentry != NULL);
+}
+
+static void
+dcache_insert(zdb_dcache_t *dcache, uint64_t parent, const char *name,
+    uint64_t child, dmu_object_type_t type)
+{
+	const uint64_t hash = dcache_hash(parent, name);
+
+	rw_enter(&dcache->lock, RW_WRITER);
+
+	/* another lookup may have resolved the same entry meanwhile */
+	if (dcache_find(dcache, hash, parent, name)) {
+		rw_exit(&dcache->lock);
+		return;
+	}
+
+	/* keep about one entry per bucket */
+	if (dcache->count == dcache->nbuckets) {
+		const size_t nbuckets = dcache->nbuckets * 2;
+		zdb_dentry_t **buckets =
+		    calloc(nbuckets, sizeof(zdb_dentry_t *));
+
+		for (size_t i = 0; i < dcache->nbuckets; i++) {
+			zdb_dentry_t *dentry = dcache->buckets[i];
+			while (dentry) {
+				zdb_dentry_t *next = dentry->next;
+				zdb_dentry_t **bucket =
+				    &buckets[dentry->hash & (nbuckets - 1)];
+				dentry->next = *bucket;
+				*bucket = dentry;
+				dentry = next;
+			}
+		}
+
+		free(dcache->buckets);
+		dcache->buckets = buckets;
+		dcache->nbuckets = nbuckets;
+	}
+
+	const size_t len = strlen(name) + 1;
+	zdb_dentry_t *dentry =
+	    c2arena_alloc(&dcache->arena, sizeof(zdb_dentry_t) + len);
+	zdb_dentry_t **bucket = &dcache->buckets[hash & (dcache->nbuckets - 1)];
+
+	dentry->hash = hash;
+	dentry->parent = parent;
+	dentry->child = child;
+	dentry->type = type;
+	memcpy(dentry->name, name, len);
+	dentry->next = *bucket;
+	*bucket = dentry;
+	dcache->count++;
+
+	rw_exit(&dcache->lock);
+}
+
+/*
+ * Resolve the first component of name, relative to the directory obj, into
+ * its object number and type through the dentry cache or the directory
+ * ZAP. Only directories and plain files are cached.
+ */
+static int
+lookup_dentry(zdb_ctx_t *ctx, zdb_dataset_t *ds, uint64_t obj,
+    const char *name, uint64_t *child_obj, dmu_object_type_t *type)
+{
+	objset_t *os = ds->os;
+	dmu_buf_t *db;
+	dmu_object_info_t doi;
+	int err;
+
+	if (dcache_lookup(&ds->dcache, obj, name, child_obj, type)) {
+		return (0);
+	}
+
+	err = zap_lookup(os, obj, name, 8, 1, child_obj);
+	if (err != 0) {
+		fprintf(stderr, "failed to lookup %s: %s\n", ctx->curpath,
+		    strerror(err));
+		return (err);
+	}
+
+	*child_obj = ZFS_DIRENT_OBJ(*child_obj);
+	err = sa_buf_hold(os, *child_obj, FTAG, &db);
+	if (err != 0) {
+		fprintf(stderr, "failed to get SA dbuf for obj %llu: %s\n",
+		    (u_longlong_t) *child_obj, strerror(err));
+		return (EINVAL);
+	}
+	dmu_object_info_from_db(db, &doi);
+	sa_buf_rele(db, FTAG);
+
+	if (doi.doi_bonus_type != DMU_OT_SA &&
+	    doi.doi_bonus_type != DMU_OT_ZNODE) {
+		fprintf(stderr, "invalid bonus type %d for obj %llu\n",
+		    doi.doi_bonus_type, (u_longlong_t) *child_obj);
+		return (EINVAL);
+	}
+
+	*type = doi.doi_type;
+	if (*type == DMU_OT_DIRECTORY_CONTENTS ||
+	    *type == DMU_OT_PLAIN_FILE_CONTENTS) {
+		dcache_insert(&ds->dcache, obj, name, *child_obj, *type);
+	}
+
+	return (0);
+}
+
+static int
+dump_path_impl(zdb_ctx_t *ctx, zdb_dataset_t *ds, uint64_t obj, char *name,
+    zpool_vdevs_t *vdevs, libzdb_map_t *map)
+{
+	char *curpath = ctx->curpath;
+	int err;
+	uint64_t child_obj;
+	dmu_object_type_t type;
+	char *s;
+
+	/* skip empty components, as in "dir//file" */
+	while (*name == '/')
+		name++;
+
+	if ((s = strchr(name, '/')) != NULL)
+		*s = '\0';
+
+	strlcat(curpath, name, sizeof(ctx->curpath));
+
+	err = lookup_dentry(ctx, ds, obj, name, &child_obj, &type);
+	if (err != 0) {
+		return (err);
+	}
+
+	strlcat(curpath, "/", sizeof(ctx->curpath));
+
+	/* whether more components follow */
+	const boolean_t more = s != NULL && s[1 + strspn(s + 1, "/")] != '\0';
+
+	switch (type) {
+	case DMU_OT_DIRECTORY_CONTENTS:
+		if (more)
+			return (dump_path_impl(
+			    ctx, ds, child_obj, s + 1, vdevs, map));
+		fprintf(stderr, "%s is a directory\n", curpath);
+		return (EISDIR);
+	case DMU_OT_PLAIN_FILE_CONTENTS:
+		if (more) {
+			fprintf(stderr, "%s is not a directory\n", curpath);
+			return (ENOTDIR);
+		}
+		return (dump_object(ctx, ds, child_obj, vdevs, map));
+	default:
+		fprintf(stderr,
+		    "object %llu has non-file "
+		    "type %d\n",
+		    (u_longlong_t) child_obj, type);
+		break;
+	}
+
+	return (EINVAL);
+}
+
+/* Called with session->lock held */
+static int
+session_pool(libzdb_session_t *session, const char *dataset, spa_t *spa,
+    zpool_vdevs_t **vdevsp)
+{
+	const size_t len = strcspn(dataset, "/@");
+	zdb_pool_t *pool;
+	int err;
+
+	for (node_t *node = c2list_head(&session->pools); node;
+	     node = c2list_next(node)) {
+		pool = c2list_get(node);
+		if (strlen(pool->name) == len &&
+		    strncmp(pool->name, dataset, len) == 0) {
+			*vdevsp = pool->vdevs;
+			return (0);
+		}
+	}
+
+	pool = malloc(sizeof(zdb_pool_t));
+	pool->name = strndup(dataset, len);
+	err = load_vdevs(spa, &pool->vdevs);
+	if (err != 0) {
+		free(pool->name);
+		free(pool);
+		return (err);
+	}
+
+	c2list_pushback(&session->pools, pool);
+	*vdevsp = pool->vdevs;
+	return (0);
+}
+
+/* Called with session->lock held */
+static int
+session_dataset(
+    libzdb_session_t *session, const char *dataset, zdb_dataset_t **dsp)
+{
+	zdb_dataset_t *ds;
+	int err;
+
+	for (node_t *node = c2list_head(&session->datasets); node;
+	     node = c2list_next(node)) {
+		ds = c2list_get(node);
+		if (strcmp(ds->name, dataset) == 0) {
+			*dsp = ds;
+			return (0);
+		}
+	}
+
+	ds = calloc(1, sizeof(zdb_dataset_t));
+	err = open_objset(
+	    dataset, DMU_OST_ZFS, session, &ds->os, &ds->sa_attr_table);
+	if (err != 0) {
+		free(ds);
+		return (err);
+	}
+
+	err = zap_lookup(
+	    ds->os, MASTER_NODE_OBJ, ZFS_ROOT_OBJ, 8, 1, &ds->root_obj);
+	if (err != 0) {
+		fprintf(stderr, "can't lookup root znode: %s\n", strerror(err));
+		close_objset(ds->os, session);
+		free(ds);
+		return (EINVAL);
+	}
 
-	return (vdevs);
+	ds->name = strdup(dataset);
+	dcache_init(&ds->dcache);
+	c2list_pushback(&session->datasets, ds);
+	*dsp = ds;
+	return (0);
+}
+
+libzdb_session_t *
+libzdb_open(const char *cachefile)
+{
+	libzdb_session_t *session = calloc(1, sizeof(libzdb_session_t));
+
+	session->cachefile = strdup(cachefile ? cachefile : ZPOOL_CACHE);
+	mutex_init(&session->lock, NULL, MUTEX_DEFAULT, NULL);
+	c2list_init(&session->pools);
+	c2list_init(&session->datasets);
+	session->prefetch = LIBZDB_DEFAULT_PREFETCH;
+	session->policy = LIBZDB_COPY_LEAST_LOADED;
+
+	/* import pools from the given cachefile */
+	spa_config_path = session->cachefile;
+	kernel_init(FREAD);
+
+	return (session);
+}
+
+void
+libzdb_set_coalesce(libzdb_session_t *session, int coalesce)
+{
+	session->coalesce = coalesce;
+}
+
+void
+libzdb_set_cache(libzdb_session_t *session, const char *dir)
+{
+	free(session->cachedir);
+	session->cachedir = dir ? strdup(dir) : NULL;
+}
+
+void
+libzdb_set_prefetch(libzdb_session_t *session, uint32_t prefetch)
+{
+	session->prefetch = prefetch;
 }
 
+void
+libzdb_set_copy_policy(
+    libzdb_session_t *session, libzdb_copy_policy_t policy)
+{
+	session->policy = policy;
+}
+
+/* Look up, loading or owning them on first use, a dataset and its pool */
 static int
-dump_path_impl(objset_t *os, uint64_t obj, char *name, zpool_vdevs_t *vdevs)
+session_hold(libzdb_session_t *session, const char *dataset,
+    zpool_vdevs_t **vdevsp, zdb_dataset_t **dsp)
 {
 	int err;
-	uint64_t child_obj;
-	char *s;
-	dmu_buf_t *db;
-	dmu_object_info_t doi;
 
-	if ((s = strchr(name, '/')) != NULL)
-		*s = '\0';
-	err = zap_lookup(os, obj, name, 8, 1, &child_obj);
+	/* the topology is that of the pool imported for the dataset */
+	mutex_enter(&session->lock);
+	err = session_dataset(session, dataset, dsp);
+	if (err == 0) {
+		err = session_pool(
+		    session, dataset, dmu_objset_spa((*dsp)->os), vdevsp);
+	}
+	mutex_exit(&session->lock);
+
+	return (err);
+}
+
+/* Request arenas start with room for a path and a few raidz maps */
+#define ARENA_CHUNK_SIZE (64 << 10)
+
+/* Take an idle arena, reused from an earlier request when possible */
+static c2arena_t *
+session_arena_get(libzdb_session_t *session)
+{
+	c2arena_t *arena = NULL;
+
+	mutex_enter(&session->lock);
+	if (session->narenas) {
+		arena = session->arenas[--session->narenas];
+	}
+	mutex_exit(&session->lock);
+
+	if (!arena) {
+		arena = malloc(sizeof(c2arena_t));
+		c2arena_init(arena, ARENA_CHUNK_SIZE);
+	}
+
+	return (arena);
+}
+
+/* Release everything allocated from arena and keep it for reuse */
+static void
+session_arena_put(libzdb_session_t *session, c2arena_t *arena)
+{
+	c2arena_reset(arena);
+
+	mutex_enter(&session->lock);
+	if (session->narenas == session->arenas_cap) {
+		session->arenas_cap =
+		    session->arenas_cap ? session->arenas_cap * 2 : 8;
+		session->arenas = realloc(session->arenas,
+		    session->arenas_cap * sizeof(c2arena_t *));
+	}
+	session->arenas[session->narenas++] = arena;
+	mutex_exit(&session->lock);
+}
+
+/*
+ * Set up ctx and a new, empty map for mapping a range of a file. Must be
+ * followed by map_finish().
+ */
+static libzdb_map_t *
+map_start(
+    zdb_ctx_t *ctx, const char *dataset, uint64_t offset, uint64_t length)
+{
+	libzdb_map_t *map;
+
+	ctx->range_start = offset;
+	ctx->range_end = (length == 0 || offset + length < offset)
+	    ? UINT64_MAX
+	    : offset + length;
+
+	ctx->prev = NULL;
+	ctx->changes = NULL;
+	ctx->copies = NULL;
+	ctx->arena = session_arena_get(ctx->session);
+
+	map = calloc(1, sizeof(libzdb_map_t));
+	map->dataset = strdup(dataset);
+	map->range_start = ctx->range_start;
+	map->range_end = ctx->range_end;
+	map->policy = ctx->session->policy;
+
+	return (map);
+}
 
-	strlcat(curpath, name, sizeof(curpath));
+/* Hand a completed map to the caller, or discard it if err is set */
+static int
+map_finish(zdb_ctx_t *ctx, int err, libzdb_map_t *map, libzdb_map_t **mapp)
+{
+	session_arena_put(ctx->session, ctx->arena);
+	ctx->arena = NULL;
 
 	if (err != 0) {
-		fprintf(stderr, "failed to lookup %s: %s\n", curpath,
-		    strerror(err));
+		libzdb_map_free(map);
 		return (err);
 	}
 
-	child_obj = ZFS_DIRENT_OBJ(child_obj);
-	err = sa_buf_hold(os, child_obj, FTAG, &db);
-	if (err != 0) {
-		fprintf(stderr, "failed to get SA dbuf for obj %llu: %s\n",
-		    (u_longlong_t) child_obj, strerror(err));
-		return (EINVAL);
+	if (ctx->session->coalesce) {
+		libzdb_map_coalesce(map);
 	}
-	dmu_object_info_from_db(db, &doi);
-	sa_buf_rele(db, FTAG);
+	*mapp = map;
 
-	if (doi.doi_bonus_type != DMU_OT_SA &&
-	    doi.doi_bonus_type != DMU_OT_ZNODE) {
-		fprintf(stderr, "invalid bonus type %d for obj %llu\n",
-		    doi.doi_bonus_type, (u_longlong_t) child_obj);
-		return (EINVAL);
+	return (0);
+}
+
+static int
+map_request(zdb_ctx_t *ctx, const char *dataset, const char *path,
+    uint64_t offset, uint64_t length, libzdb_map_t **mapp)
+{
+	zpool_vdevs_t *vdevs;
+	zdb_dataset_t *ds;
+	libzdb_map_t *map;
+	char *name;
+	int err;
+
+	err = session_hold(ctx->session, dataset, &vdevs, &ds);
+	if (err != 0) {
+		return (err);
 	}
 
-	strlcat(curpath, "/", sizeof(curpath));
+	snprintf(ctx->curpath, sizeof(ctx->curpath), "dataset=%s path=/",
+	    dataset);
 
-	switch (doi.doi_type) {
-		/* case DMU_OT_DIRECTORY_CONTENTS: */
-		/*   if (s != NULL && *(s + 1) != '\0') */
-		/*     return dump_path_impl (os, child_obj, s + 1); */
-		/*FALLTHROUGH*/
-	case DMU_OT_PLAIN_FILE_CONTENTS:
-		dump_object(os, child_obj, vdevs);
-		return (0);
-	default:
-		fprintf(stderr,
-		    "object %llu has non-file "
-		    "type %d\n",
-		    (u_longlong_t) obj, doi.doi_type);
-		break;
+	map = map_start(ctx, dataset, offset, length);
+
+	/* dump_path_impl() splits the path in place */
+	if ((name = c2arena_strdup(ctx->arena, path)) == NULL) {
+		err = ENOMEM;
+	} else {
+		err = dump_path_impl(ctx, ds, ds->root_obj, name, vdevs, map);
 	}
 
-	return (EINVAL);
+	return (map_finish(ctx, err, map, mapp));
 }
 
+/*
+ * Map a range of a file by object number, updating prev if it is not NULL
+ * (prev requires the whole file)
+ */
 static int
-dump_path(char *ds, char *path, zpool_vdevs_t *vdevs)
+map_object(libzdb_session_t *session, const char *dataset, uint64_t object,
+    uint64_t offset, uint64_t length, const libzdb_map_t *prev,
+    libzdb_map_t **mapp)
 {
+	zdb_ctx_t ctx;
+	zpool_vdevs_t *vdevs;
+	zdb_dataset_t *ds;
+	dmu_object_info_t doi;
 	int err;
-	objset_t *os = NULL;
-	uint64_t root_obj;
 
-	err = open_objset(ds, DMU_OST_ZFS, FTAG, &os);
+	err = session_hold(session, dataset, &vdevs, &ds);
 	if (err != 0) {
 		return (err);
 	}
 
-	err = zap_lookup(os, MASTER_NODE_OBJ, ZFS_ROOT_OBJ, 8, 1, &root_obj);
+	err = dmu_object_info(ds->os, object, &doi);
 	if (err != 0) {
-		fprintf(stderr, "can't lookup root znode: %s\n", strerror(err));
-		dmu_objset_disown(os, B_FALSE, FTAG);
+		return (err);
+	}
+	if (doi.doi_type != DMU_OT_PLAIN_FILE_CONTENTS) {
+		fprintf(stderr, "object %llu has non-file type %d\n",
+		    (u_longlong_t) object, doi.doi_type);
+		return (EINVAL);
+	}
+
+	ctx.session = session;
+	snprintf(ctx.curpath, sizeof(ctx.curpath), "dataset=%s obj=%llu",
+	    dataset, (u_longlong_t) object);
+
+	libzdb_map_t *map = map_start(&ctx, dataset, offset, length);
+	ctx.prev = prev;
+	err = dump_object(&ctx, ds, object, vdevs, map);
+
+	return (map_finish(&ctx, err, map, mapp));
+}
+
+int
+libzdb_map_object(libzdb_session_t *session, const char *dataset,
+    uint64_t object, libzdb_map_t **mapp)
+{
+	return (map_object(session, dataset, object, 0, 0, NULL, mapp));
+}
+
+int
+libzdb_remap(
+    libzdb_session_t *session, const libzdb_map_t *prev, libzdb_map_t **mapp)
+{
+	if (prev->range_start != 0 || prev->range_end != UINT64_MAX) {
 		return (EINVAL);
 	}
 
-	snprintf(curpath, sizeof(curpath), "dataset=%s path=/", ds);
+	return (map_object(
+	    session, prev->dataset, prev->object, 0, 0, prev, mapp));
+}
+
+int
+libzdb_next_file(
+    libzdb_session_t *session, const char *dataset, uint64_t *object)
+{
+	zpool_vdevs_t *vdevs;
+	zdb_dataset_t *ds;
+	dmu_object_info_t doi;
+	int err;
+
+	err = session_hold(session, dataset, &vdevs, &ds);
+	if (err != 0) {
+		return (err);
+	}
 
-	err = dump_path_impl(os, root_obj, path, vdevs);
+	while ((err = dmu_object_next(ds->os, object, B_FALSE, 0)) == 0) {
+		if (dmu_object_info(ds->os, *object, &doi) == 0 &&
+		    doi.doi_type == DMU_OT_PLAIN_FILE_CONTENTS) {
+			return (0);
+		}
+	}
 
-	close_objset(os, FTAG);
 	return (err);
 }
 
+int
+libzdb_map_range(libzdb_session_t *session, const char *dataset,
+    const char *path, uint64_t offset, uint64_t length, libzdb_map_t **mapp)
+{
+	zdb_ctx_t ctx;
+
+	ctx.session = session;
+
+	return (map_request(&ctx, dataset, path, offset, length, mapp));
+}
+
+int
+libzdb_map_file(libzdb_session_t *session, const char *dataset,
+    const char *path, libzdb_map_t **mapp)
+{
+	return (libzdb_map_range(session, dataset, path, 0, 0, mapp));
+}
+
+/*
+ * How many of the last extents libzdb_map_coalesce() considers joining an
+ * extent to. The copies of a block come between an extent and the same
+ * copy of the block before.
+ */
+#define COALESCE_WINDOW 16
+
+size_t
+libzdb_map_coalesce(libzdb_map_t *map)
+{
+	size_t n = 0;
+
+	for (size_t i = 0; i < map->nextents; i++) {
+		const libzdb_extent_t *ext = &map->extents[i];
+		libzdb_extent_t *prev = NULL;
+
+		/*
+		 * Joining an earlier extent keeps the extents in file order:
+		 * those in between start no earlier than it does.
+		 */
+		for (size_t j = n; j > 0 && n - j < COALESCE_WINDOW; j--) {
+			libzdb_extent_t *cand = &map->extents[j - 1];
+
+			if (cand->dev == ext->dev &&
+			    ((cand->flags ^ ext->flags) &
+				~LIBZDB_EXTENT_CHECKSUM) == 0 &&
+			    !(ext->flags & LIBZDB_EXTENT_COMPRESSED) &&
+			    cand->dev_offset + cand->length ==
+				ext->dev_offset &&
+			    cand->file_offset + cand->length ==
+				ext->file_offset) {
+				prev = cand;
+				break;
+			}
+		}
+
+		if (prev) {
+			prev->length += ext->length;
+			prev->flags &= ~LIBZDB_EXTENT_CHECKSUM;
+		} else {
+			map->extents[n++] = *ext;
+		}
+	}
+
+	const size_t merged = map->nextents - n;
+	map->nextents = n;
+	map->merged += merged;
+
+	return (merged);
+}
+
 static void
-cleanup_vdevs(zpool_vdevs_t *vdevs)
+extent_write_text(
+    const libzdb_map_t *map, const libzdb_extent_t *ext, FILE *out)
 {
-	for (size_t i = 0; i < vdevs->count; i++) {
-		zpool_vdev_t *vdev = &(vdevs->vdevs[i]);
-		for (size_t j = 0; j < vdev->count; j++) {
-			free(vdev->names[j]);
+	const libzdb_block_t *info = &map->blocks[ext->block];
+
+	if (ext->flags & LIBZDB_EXTENT_EMBEDDED) {
+		fprintf(out, "embedded offset=%lu size=%lu", ext->dev_offset,
+		    ext->length);
+	} else if (ext->flags & LIBZDB_EXTENT_RAIDZ) {
+		fprintf(out, "col=%02u devidx=%02u dev=%s offset=%lu size=%lu",
+		    ext->col, ext->child, map->devs[ext->dev], ext->dev_offset,
+		    ext->length);
+	} else {
+		fprintf(out,
+		    "vdevidx=%u "
+		    "dev=%s "
+		    "offset=%lu "
+		    "size=%lu",
+		    map->dev_vdevs[ext->dev], map->devs[ext->dev],
+		    ext->dev_offset, ext->length);
+	}
+	if (ext->flags & LIBZDB_EXTENT_COMPRESSED) {
+		fprintf(out, " compress=%s lsize=%u psize=%u zoffset=%lu",
+		    info->compress < ZIO_COMPRESS_FUNCTIONS
+			? zio_compress_table[info->compress].ci_name
+			: "unknown",
+		    info->file_data, info->physical_file_data,
+		    ext->file_offset - info->file_offset);
+	}
+	if (ext->flags & LIBZDB_EXTENT_CHECKSUM) {
+		fprintf(out,
+		    " checksum=%s cksize=%lu ckoffset=%lu "
+		    "cksum=%llx:%llx:%llx:%llx",
+		    info->checksum < ZIO_CHECKSUM_FUNCTIONS
+			? zio_checksum_table[info->checksum].ci_name
+			: "unknown",
+		    block_psize(info),
+		    ext->file_offset - (info->file_offset + info->gang_offset),
+		    (u_longlong_t) info->cksum[0],
+		    (u_longlong_t) info->cksum[1],
+		    (u_longlong_t) info->cksum[2],
+		    (u_longlong_t) info->cksum[3]);
+		if (info->flags & LIBZDB_BLOCK_BYTESWAP) {
+			fprintf(out, " byteswap");
 		}
-		free(vdev->names);
 	}
-	free(vdevs->vdevs);
-	free(vdevs);
+	fprintf(out, "%s\n", ext->flags & LIBZDB_EXTENT_COPY ? " copy" : "");
+}
+
+static void
+map_write_text(const libzdb_map_t *map, FILE *out)
+{
+	size_t e = 0;
+
+	fprintf(out, "file size: %lu (%zu L0 BPs)\n", map->file_size,
+	    map->nblocks);
+	if (map->range_start != 0 || map->range_end != UINT64_MAX) {
+		fprintf(out, "range: [%lu, %lu)\n", map->range_start,
+		    MIN(map->range_end, map->file_size));
+	}
+	if (map->merged) {
+		fprintf(out, "extents: %zu (%zu merged)\n", map->nextents,
+		    map->merged);
+	}
+
+	for (size_t b = 0; b < map->nblocks; b++) {
+		const libzdb_block_t *info = &map->blocks[b];
+
+		/* extents of a remapped map may lie between its blocks */
+		for (; e < map->nextents &&
+		     map->extents[e].file_offset < info->file_offset;
+		     e++) {
+			extent_write_text(map, &map->extents[e], out);
+		}
+
+		fprintf(out,
+		    "BP: file_offset=%ld, file_data=%u, "
+		    "physical_file_data=%u, "
+		    "vdev=%u, io_offset=%ld, record_size=%u, "
+		    "effective_record_size=%u\n",
+		    info->file_offset, info->file_data,
+		    info->physical_file_data, info->vdev, info->offset,
+		    info->physical_file_data, info->actual_size);
+
+		/* extents are in file order, so are those of each block */
+		for (; e < map->nextents &&
+		     map->extents[e].file_offset <
+			 info->file_offset + info->file_data;
+		     e++) {
+			extent_write_text(map, &map->extents[e], out);
+		}
+	}
+
+	/* joined extents may run past the data of the last block */
+	for (; e < map->nextents; e++) {
+		extent_write_text(map, &map->extents[e], out);
+	}
 }
 
 int
-main(int argc, char *argv[])
+libzdb_map_write(const libzdb_map_t *map, FILE *out, libzdb_format_t format)
 {
-	if (argc < 3) {
-		fprintf(stderr, "Syntax: %s zpool filename\n", argv[0]);
-		return (1);
+	switch (format) {
+	case LIBZDB_FORMAT_TEXT:
+		map_write_text(map, out);
+		break;
+	case LIBZDB_FORMAT_BINARY:
+		mapio_write(map, out);
+		break;
+	case LIBZDB_FORMAT_PLAN:;
+		libzdb_plan_t *plan;
+		int err = libzdb_plan_build(map, map->policy, NULL, &plan);
+		if (err != 0) {
+			return (err);
+		}
+		err = libzdb_plan_write(plan, out);
+		libzdb_plan_free(plan);
+		return (err);
+	default:
+		return (EINVAL);
 	}
 
-	memset(dump_opt, 0, sizeof(dump_opt));
-	kernel_init(FREAD);
-	dump_opt['v'] = 99;
-	zpool_vdevs_t *vdevs = dump_cachefile(ZPOOL_CACHE, argv[1]);
-	dump_path(argv[1], argv[2], vdevs);
-	cleanup_vdevs(vdevs);
+	return (ferror(out) ? EIO : 0);
+}
+
+void
+libzdb_map_free(libzdb_map_t *map)
+{
+	if (!map) {
+		return;
+	}
+
+	/* the device table belongs to the session */
+	free(map->dataset);
+	free(map->blocks);
+	free(map->extents);
+	free(map->embedded);
+	free(map);
+}
+
+/* state shared by the tasks of one libzdb_map_files() call */
+typedef struct zdb_batch {
+	libzdb_session_t *session;
+	kmutex_t lock; /* serializes writes to out and calls to done */
+	FILE *out;
+	libzdb_format_t format;
+	libzdb_done_func_t *done;
+	void *arg;
+	size_t failed; /* protected by lock */
+	kcondvar_t cv; /* signalled when a task completes */
+	size_t queued; /* tasks dispatched and not done, under lock */
+	size_t maxqueued;
+	taskq_t *tq;
+} zdb_batch_t;
+
+typedef struct zdb_task {
+	zdb_batch_t *batch;
+	libzdb_request_t *req;
+	/* the request of a libzdb_map_dataset() task, freed with the task */
+	libzdb_request_t own;
+} zdb_task_t;
+
+/*
+ * Map one request of a batch. The map is written under the batch lock so
+ * that it reaches the shared stream in one piece no matter how many workers
+ * are running.
+ */
+static void
+map_task(void *arg)
+{
+	zdb_task_t *task = arg;
+	zdb_batch_t *batch = task->batch;
+	libzdb_request_t *req = task->req;
+	libzdb_map_t *map = NULL;
+	zdb_ctx_t ctx;
+
+	if (req->path) {
+		ctx.session = batch->session;
+		req->status = map_request(&ctx, req->dataset, req->path,
+		    req->offset, req->length, &map);
+	} else {
+		req->status = map_object(batch->session, req->dataset,
+		    req->object, req->offset, req->length, NULL, &map);
+	}
+
+	mutex_enter(&batch->lock);
+	if (req->status == 0) {
+		req->status = libzdb_map_write(map, batch->out, batch->format);
+	}
+	if (req->status != 0) {
+		batch->failed++;
+	}
+	if (batch->done) {
+		batch->done(req, batch->arg);
+	}
+	batch->queued--;
+	cv_signal(&batch->cv);
+	mutex_exit(&batch->lock);
+
+	libzdb_map_free(map);
+	if (req == &task->own) {
+		free(task);
+	}
+}
+
+/*
+ * Start the workers of a batch. At most maxqueued tasks are in flight at a
+ * time; batch_dispatch() of another waits for one of them to complete.
+ */
+static void
+batch_start(zdb_batch_t *batch, libzdb_session_t *session, int nthreads,
+    size_t maxqueued, FILE *out, libzdb_format_t format,
+    libzdb_done_func_t *done, void *arg)
+{
+	batch->session = session;
+	mutex_init(&batch->lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&batch->cv, NULL, CV_DEFAULT, NULL);
+	batch->out = out;
+	batch->format = format;
+	batch->done = done;
+	batch->arg = arg;
+	batch->failed = 0;
+	batch->queued = 0;
+	batch->maxqueued = maxqueued;
+	/*
+	 * The taskq's own maxalloc only delays an allocation past the limit
+	 * by a second before making it anyway, so the bound is kept above.
+	 */
+	batch->tq = taskq_create("libzdb_map", nthreads, defclsyspri, nthreads,
+	    INT_MAX, TASKQ_PREPOPULATE);
+}
+
+static void
+batch_dispatch(zdb_batch_t *batch, zdb_task_t *task)
+{
+	mutex_enter(&batch->lock);
+	while (batch->queued >= batch->maxqueued) {
+		cv_wait(&batch->cv, &batch->lock);
+	}
+	batch->queued++;
+	mutex_exit(&batch->lock);
+
+	VERIFY(taskq_dispatch(batch->tq, map_task, task, TQ_SLEEP) != 0);
+}
+
+/* Wait for the tasks of a batch and return the number that failed */
+static size_t
+batch_finish(zdb_batch_t *batch)
+{
+	taskq_wait(batch->tq);
+	taskq_destroy(batch->tq);
+	cv_destroy(&batch->cv);
+	mutex_destroy(&batch->lock);
+
+	return (batch->failed);
+}
+
+size_t
+libzdb_map_files(libzdb_session_t *session, libzdb_request_t *reqs,
+    size_t count, int nthreads, FILE *out, libzdb_format_t format,
+    libzdb_done_func_t *done, void *arg)
+{
+	zdb_batch_t batch;
+	zdb_task_t *tasks;
+	size_t failed;
+
+	if (nthreads <= 0) {
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	tasks = calloc(count, sizeof(zdb_task_t));
+	batch_start(
+	    &batch, session, nthreads, count, out, format, done, arg);
+
+	for (size_t i = 0; i < count; i++) {
+		tasks[i].batch = &batch;
+		tasks[i].req = &reqs[i];
+		batch_dispatch(&batch, &tasks[i]);
+	}
+
+	failed = batch_finish(&batch);
+	free(tasks);
+
+	return (failed);
+}
+
+size_t
+libzdb_map_dataset(libzdb_session_t *session, const char *dataset,
+    uint64_t offset, uint64_t length, int nthreads, FILE *out,
+    libzdb_format_t format, libzdb_done_func_t *done, void *arg)
+{
+	zdb_batch_t batch;
+	uint64_t object = 0;
+	int err;
+
+	if (nthreads <= 0) {
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	/*
+	 * Objects are listed while earlier ones are mapped; at most four
+	 * files per worker are in flight, so the listing stays just ahead
+	 * of the workers and the tasks of a large dataset are never all
+	 * allocated at once.
+	 */
+	batch_start(
+	    &batch, session, nthreads, 4 * nthreads, out, format, done, arg);
+
+	while ((err = libzdb_next_file(session, dataset, &object)) == 0) {
+		zdb_task_t *task = malloc(sizeof(zdb_task_t));
+
+		task->batch = &batch;
+		task->req = &task->own;
+		task->own.dataset = dataset;
+		task->own.path = NULL;
+		task->own.offset = offset;
+		task->own.length = length;
+		task->own.status = 0;
+		task->own.object = object;
+		batch_dispatch(&batch, task);
+	}
+
+	size_t failed = batch_finish(&batch);
+	if (err != ESRCH) {
+		fprintf(stderr, "failed to list the files of '%s': %s\n",
+		    dataset, strerror(err));
+		failed++;
+	}
+
+	return (failed);
+}
+
+void
+libzdb_close(libzdb_session_t *session)
+{
+	if (!session) {
+		return;
+	}
+
+	for (node_t *node = c2list_head(&session->datasets); node;
+	     node = c2list_next(node)) {
+		zdb_dataset_t *ds = c2list_get(node);
+		close_objset(ds->os, session);
+		dcache_fin(&ds->dcache);
+		free(ds->name);
+	}
+	c2list_fin(&session->datasets, free);
+
+	for (node_t *node = c2list_head(&session->pools); node;
+	     node = c2list_next(node)) {
+		zdb_pool_t *pool = c2list_get(node);
+		cleanup_vdevs(pool->vdevs);
+		free(pool->name);
+	}
+	c2list_fin(&session->pools, free);
+
+	for (size_t i = 0; i < session->narenas; i++) {
+		c2arena_fin(session->arenas[i]);
+		free(session->arenas[i]);
+	}
+	free(session->arenas);
+
 	kernel_fini();
 
-	return (0);
+	mutex_destroy(&session->lock);
+	free(session->cachedir);
+	free(session->cachefile);
+	free(session);
 }
@@ -0,0 +1,325 @@
+#include "mapio.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+static uint8_t *
+put_le32(uint8_t *p, uint32_t v)
+{
+	for (int i = 0; i < 4; i++) {
+		*p++ = v >> (8 * i);
+	}
+	return (p);
+}
+
+static uint8_t *
+put_le64(uint8_t *p, uint64_t v)
+{
+	for (int i = 0; i < 8; i++) {
+		*p++ = v >> (8 * i);
+	}
+	return (p);
+}
+
+static const uint8_t *
+get_le32(const uint8_t *p, uint32_t *v)
+{
+	*v = 0;
+	for (int i = 0; i < 4; i++) {
+		*v |= (uint32_t) *p++ << (8 * i);
+	}
+	return (p);
+}
+
+static const uint8_t *
+get_le64(const uint8_t *p, uint64_t *v)
+{
+	*v = 0;
+	for (int i = 0; i < 8; i++) {
+		*v |= (uint64_t) *p++ << (8 * i);
+	}
+	return (p);
+}
+
+/* The fields of a header, encoded and decoded below in the same order */
+typedef struct mapio_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t ndevs;
+	uint64_t pool_guid;
+	uint64_t object;
+	uint64_t txg;
+	uint64_t file_size;
+	uint64_t dev_health;
+	uint64_t nblocks;
+	uint64_t nextents;
+	uint64_t embedded_len;
+	uint8_t cksum_salt[32];
+	uint32_t dataset_len;
+} mapio_header_t;
+
+static void
+header_encode(const mapio_header_t *hdr, uint8_t *buf)
+{
+	uint8_t *p = buf;
+
+	memcpy(p, hdr->magic, 8);
+	p = put_le32(p + 8, hdr->version);
+	p = put_le32(p, hdr->ndevs);
+	p = put_le64(p, hdr->pool_guid);
+	p = put_le64(p, hdr->object);
+	p = put_le64(p, hdr->txg);
+	p = put_le64(p, hdr->file_size);
+	p = put_le64(p, hdr->dev_health);
+	p = put_le64(p, hdr->nblocks);
+	p = put_le64(p, hdr->nextents);
+	p = put_le64(p, hdr->embedded_len);
+	memcpy(p, hdr->cksum_salt, 32);
+	put_le32(p + 32, hdr->dataset_len);
+}
+
+static void
+header_decode(const uint8_t *buf, mapio_header_t *hdr)
+{
+	const uint8_t *p = buf;
+
+	memcpy(hdr->magic, p, 8);
+	p = get_le32(p + 8, &hdr->version);
+	p = get_le32(p, &hdr->ndevs);
+	p = get_le64(p, &hdr->pool_guid);
+	p = get_le64(p, &hdr->object);
+	p = get_le64(p, &hdr->txg);
+	p = get_le64(p, &hdr->file_size);
+	p = get_le64(p, &hdr->dev_health);
+	p = get_le64(p, &hdr->nblocks);
+	p = get_le64(p, &hdr->nextents);
+	p = get_le64(p, &hdr->embedded_len);
+	memcpy(hdr->cksum_salt, p, 32);
+	get_le32(p + 32, &hdr->dataset_len);
+}
+
+static void
+block_encode(const libzdb_block_t *info, uint8_t *buf)
+{
+	uint8_t *p = buf;
+
+	p = put_le64(p, info->file_offset);
+	p = put_le64(p, info->offset);
+	p = put_le32(p, info->vdev);
+	p = put_le32(p, info->file_data);
+	p = put_le32(p, info->physical_file_data);
+	p = put_le32(p, info->actual_size);
+	p = put_le32(p, info->gang_offset);
+	p = put_le32(p, info->gang_size);
+	*p++ = info->compress;
+	*p++ = info->checksum;
+	*p++ = info->flags;
+	*p++ = info->ndvas;
+	for (int k = 0; k < 4; k++) {
+		p = put_le64(p, info->cksum[k]);
+	}
+}
+
+static void
+block_decode(const uint8_t *buf, libzdb_block_t *info)
+{
+	const uint8_t *p = buf;
+
+	memset(info, 0, sizeof(libzdb_block_t));
+	p = get_le64(p, &info->file_offset);
+	p = get_le64(p, &info->offset);
+	p = get_le32(p, &info->vdev);
+	p = get_le32(p, &info->file_data);
+	p = get_le32(p, &info->physical_file_data);
+	p = get_le32(p, &info->actual_size);
+	p = get_le32(p, &info->gang_offset);
+	p = get_le32(p, &info->gang_size);
+	info->compress = *p++;
+	info->checksum = *p++;
+	info->flags = *p++;
+	info->ndvas = *p++;
+	for (int k = 0; k < 4; k++) {
+		p = get_le64(p, &info->cksum[k]);
+	}
+}
+
+static void
+extent_encode(const libzdb_extent_t *ext, uint8_t *buf)
+{
+	uint8_t *p = buf;
+
+	p = put_le32(p, ext->dev);
+	p = put_le32(p, ext->flags);
+	p = put_le64(p, ext->dev_offset);
+	p = put_le64(p, ext->length);
+	p = put_le64(p, ext->file_offset);
+	p = put_le32(p, ext->block);
+	p = put_le32(p, ext->child | (uint32_t) ext->col << 16);
+}
+
+static void
+extent_decode(const uint8_t *buf, libzdb_extent_t *ext)
+{
+	const uint8_t *p = buf;
+	uint32_t childcol;
+
+	p = get_le32(p, &ext->dev);
+	p = get_le32(p, &ext->flags);
+	p = get_le64(p, &ext->dev_offset);
+	p = get_le64(p, &ext->length);
+	p = get_le64(p, &ext->file_offset);
+	p = get_le32(p, &ext->block);
+	p = get_le32(p, &childcol);
+	ext->child = childcol & 0xffff;
+	ext->col = childcol >> 16;
+}
+
+void
+mapio_write(const libzdb_map_t *map, FILE *out)
+{
+	uint8_t buf[4096];
+	uint8_t *p = buf;
+	mapio_header_t hdr;
+
+	memcpy(hdr.magic, LIBZDB_MAP_MAGIC, 8);
+	hdr.version = LIBZDB_MAP_VERSION;
+	hdr.ndevs = map->ndevs;
+	hdr.pool_guid = map->pool_guid;
+	hdr.object = map->object;
+	hdr.txg = map->txg;
+	hdr.file_size = map->file_size;
+	hdr.dev_health = map->dev_health;
+	hdr.nblocks = map->nblocks;
+	hdr.nextents = map->nextents;
+	hdr.embedded_len = map->embedded_len;
+	memcpy(hdr.cksum_salt, map->cksum_salt, 32);
+	hdr.dataset_len = strlen(map->dataset);
+	header_encode(&hdr, buf);
+	fwrite(buf, 1, MAPIO_HEADER_SIZE, out);
+	fwrite(map->dataset, 1, hdr.dataset_len, out);
+
+	for (size_t i = 0; i < map->ndevs; i++) {
+		const uint32_t len = strlen(map->devs[i]);
+
+		put_le32(put_le32(buf, map->dev_vdevs[i]), len);
+		fwrite(buf, 1, 8, out);
+		fwrite(map->devs[i], 1, len, out);
+	}
+
+	/* encode blocks and extents a buffer at a time */
+	for (size_t i = 0; i < map->nblocks; i++) {
+		block_encode(&map->blocks[i], p);
+		p += MAPIO_BLOCK_SIZE;
+		if (p + MAPIO_BLOCK_SIZE > buf + sizeof(buf)) {
+			fwrite(buf, 1, p - buf, out);
+			p = buf;
+		}
+	}
+	for (size_t i = 0; i < map->nextents; i++) {
+		extent_encode(&map->extents[i], p);
+		p += MAPIO_EXTENT_SIZE;
+		if (p + MAPIO_EXTENT_SIZE > buf + sizeof(buf)) {
+			fwrite(buf, 1, p - buf, out);
+			p = buf;
+		}
+	}
+	fwrite(buf, 1, p - buf, out);
+
+	fwrite(map->embedded, 1, map->embedded_len, out);
+}
+
+int
+mapio_read(FILE *in, libzdb_map_t *map)
+{
+	uint8_t buf[4096];
+	mapio_header_t hdr;
+	int err = ENOENT;
+
+	if (fread(buf, 1, MAPIO_HEADER_SIZE, in) != MAPIO_HEADER_SIZE) {
+		return (ENOENT);
+	}
+	header_decode(buf, &hdr);
+
+	if (memcmp(hdr.magic, LIBZDB_MAP_MAGIC, 8) != 0 ||
+	    hdr.version != LIBZDB_MAP_VERSION || hdr.ndevs != map->ndevs ||
+	    hdr.pool_guid != map->pool_guid || hdr.object != map->object ||
+	    hdr.dev_health != map->dev_health ||
+	    fseek(in, hdr.dataset_len, SEEK_CUR) != 0) {
+		return (ENOENT);
+	}
+
+	for (size_t i = 0; i < hdr.ndevs; i++) {
+		uint32_t vdev;
+		uint32_t len;
+
+		if (fread(buf, 1, 8, in) != 8) {
+			return (ENOENT);
+		}
+		get_le32(get_le32(buf, &vdev), &len);
+		if (vdev != map->dev_vdevs[i] || len != strlen(map->devs[i]) ||
+		    fread(buf, 1, len, in) != len ||
+		    memcmp(buf, map->devs[i], len) != 0) {
+			return (ENOENT);
+		}
+	}
+
+	map->blocks = malloc(MAX(hdr.nblocks, 1) * sizeof(libzdb_block_t));
+	map->blocks_cap = MAX(hdr.nblocks, 1);
+	map->nblocks = 0;
+	map->extents =
+	    malloc(MAX(hdr.nextents, 1) * sizeof(libzdb_extent_t));
+	map->extents_cap = MAX(hdr.nextents, 1);
+	map->nextents = 0;
+	map->embedded = NULL;
+	for (size_t i = 0; i < hdr.nblocks; i++) {
+		if (fread(buf, 1, MAPIO_BLOCK_SIZE, in) != MAPIO_BLOCK_SIZE) {
+			goto out;
+		}
+		block_decode(buf, &map->blocks[i]);
+		map->nblocks++;
+	}
+	for (size_t i = 0; i < hdr.nextents; i++) {
+		libzdb_extent_t *ext = &map->extents[i];
+
+		if (fread(buf, 1, MAPIO_EXTENT_SIZE, in) != MAPIO_EXTENT_SIZE) {
+			goto out;
+		}
+		extent_decode(buf, ext);
+		if (ext->dev >= hdr.ndevs || ext->block >= hdr.nblocks ||
+		    ((ext->flags & LIBZDB_EXTENT_EMBEDDED) &&
+			ext->dev_offset + ext->length > hdr.embedded_len)) {
+			goto out;
+		}
+		map->nextents++;
+	}
+
+	map->embedded = malloc(MAX(hdr.embedded_len, 1));
+	map->embedded_cap = MAX(hdr.embedded_len, 1);
+	if (fread(map->embedded, 1, hdr.embedded_len, in) !=
+	    hdr.embedded_len) {
+		goto out;
+	}
+	map->embedded_len = hdr.embedded_len;
+	map->txg = hdr.txg;
+	map->file_size = hdr.file_size;
+	err = 0;
+
+out:
+	if (err) {
+		free(map->blocks);
+		map->blocks = NULL;
+		map->nblocks = 0;
+		map->blocks_cap = 0;
+		free(map->extents);
+		map->extents = NULL;
+		map->nextents = 0;
+		map->extents_cap = 0;
+		free(map->embedded);
+		map->embedded = NULL;
+		map->embedded_len = 0;
+		map->embedded_cap = 0;
+	}
+	return (err);
+}
@@ -0,0 +1,186 @@
+#include "mapio.h"
+#include "test.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Field by field, blocks and extents have padding */
+static int
+block_equal(const libzdb_block_t *a, const libzdb_block_t *b)
+{
+	return (a->file_offset == b->file_offset &&
+	    a->file_data == b->file_data &&
+	    a->physical_file_data == b->physical_file_data &&
+	    a->vdev == b->vdev && a->offset == b->offset &&
+	    a->actual_size == b->actual_size && a->compress == b->compress &&
+	    a->flags == b->flags && a->ndvas == b->ndvas &&
+	    a->gang_offset == b->gang_offset && a->gang_size == b->gang_size &&
+	    a->checksum == b->checksum &&
+	    memcmp(a->cksum, b->cksum, sizeof(a->cksum)) == 0);
+}
+
+static int
+extent_equal(const libzdb_extent_t *a, const libzdb_extent_t *b)
+{
+	return (a->file_offset == b->file_offset &&
+	    a->dev_offset == b->dev_offset && a->length == b->length &&
+	    a->dev == b->dev && a->flags == b->flags &&
+	    a->block == b->block && a->child == b->child && a->col == b->col);
+}
+
+/* A map set up for mapio_read() to fill in, as cache_load() does */
+static void
+make_entry(const libzdb_map_t *map, libzdb_map_t *entry)
+{
+	memset(entry, 0, sizeof(libzdb_map_t));
+	entry->pool_guid = map->pool_guid;
+	entry->object = map->object;
+	entry->devs = map->devs;
+	entry->dev_vdevs = map->dev_vdevs;
+	entry->dev_health = map->dev_health;
+	entry->ndevs = map->ndevs;
+}
+
+static void
+test_round_trip(void)
+{
+	libzdb_block_t blocks[4];
+	libzdb_extent_t extents[4];
+	uint8_t embedded[100];
+	libzdb_map_t map, entry;
+	FILE *fp = tmpfile();
+	size_t devs_size = 0;
+
+	test_make_map(&map, blocks, extents, embedded);
+	for (size_t i = 0; i < map.ndevs; i++) {
+		devs_size += 8 + strlen(map.devs[i]);
+	}
+	mapio_write(&map, fp);
+	/*
+	 * The header, dataset name, device table, blocks, extents and
+	 * payloads: the compression and checksum of a block are not repeated
+	 * by each of its extents.
+	 */
+	CHECK((size_t) ftell(fp) == MAPIO_HEADER_SIZE + 9 + devs_size +
+		4 * MAPIO_BLOCK_SIZE + 4 * MAPIO_EXTENT_SIZE + 100);
+	CHECK(MAPIO_EXTENT_SIZE == 40);
+	rewind(fp);
+
+	make_entry(&map, &entry);
+	CHECK(mapio_read(fp, &entry) == 0);
+	CHECK(entry.txg == map.txg);
+	CHECK(entry.file_size == map.file_size);
+	CHECK(entry.nblocks == map.nblocks);
+	for (size_t i = 0; i < entry.nblocks && i < map.nblocks; i++) {
+		CHECK(block_equal(&entry.blocks[i], &map.blocks[i]));
+	}
+	CHECK(entry.nextents == map.nextents);
+	for (size_t i = 0; i < entry.nextents && i < map.nextents; i++) {
+		CHECK(extent_equal(&entry.extents[i], &map.extents[i]));
+	}
+	CHECK(entry.embedded_len == map.embedded_len);
+	CHECK(memcmp(entry.embedded, map.embedded, map.embedded_len) == 0);
+	/* the whole stream was consumed */
+	CHECK(fgetc(fp) == EOF);
+
+	free(entry.blocks);
+	free(entry.extents);
+	free(entry.embedded);
+	fclose(fp);
+}
+
+/*
+ * Entries of another pool, object, device table or state of the devices
+ * are not used
+ */
+static void
+test_mismatch(void)
+{
+	libzdb_block_t blocks[4];
+	libzdb_extent_t extents[4];
+	uint8_t embedded[100];
+	char *other[TEST_NDEVS];
+	uint32_t moved[TEST_NDEVS];
+	libzdb_map_t map, entry;
+	FILE *fp = tmpfile();
+
+	test_make_map(&map, blocks, extents, embedded);
+	mapio_write(&map, fp);
+	/* a device replaced by another, and one moved to another vdev */
+	memcpy(other, map.devs, sizeof(other));
+	other[1] = "/dev/sdz";
+	memcpy(moved, map.dev_vdevs, sizeof(moved));
+	moved[1] = 1;
+
+	rewind(fp);
+	make_entry(&map, &entry);
+	entry.pool_guid++;
+	CHECK(mapio_read(fp, &entry) == ENOENT);
+
+	rewind(fp);
+	make_entry(&map, &entry);
+	entry.object++;
+	CHECK(mapio_read(fp, &entry) == ENOENT);
+
+	rewind(fp);
+	make_entry(&map, &entry);
+	entry.devs = other;
+	CHECK(mapio_read(fp, &entry) == ENOENT);
+	CHECK(entry.extents == NULL && entry.nextents == 0);
+
+	/* the same devices on other vdevs */
+	rewind(fp);
+	make_entry(&map, &entry);
+	entry.dev_vdevs = moved;
+	CHECK(mapio_read(fp, &entry) == ENOENT);
+
+	/* a device faulted or back since the entry was made */
+	rewind(fp);
+	make_entry(&map, &entry);
+	entry.dev_health++;
+	CHECK(mapio_read(fp, &entry) == ENOENT);
+	CHECK(entry.blocks == NULL && entry.extents == NULL);
+
+	fclose(fp);
+}
+
+/* A truncated entry is rejected rather than read in part */
+static void
+test_truncated(void)
+{
+	libzdb_block_t blocks[4];
+	libzdb_extent_t extents[4];
+	uint8_t embedded[100];
+	libzdb_map_t map, entry;
+	FILE *fp = tmpfile();
+	FILE *cut = tmpfile();
+	int c;
+
+	test_make_map(&map, blocks, extents, embedded);
+	mapio_write(&map, fp);
+	const long len = ftell(fp);
+	rewind(fp);
+	for (long i = 0; i < len - 1 && (c = fgetc(fp)) != EOF; i++) {
+		fputc(c, cut);
+	}
+	rewind(cut);
+
+	make_entry(&map, &entry);
+	CHECK(mapio_read(cut, &entry) == ENOENT);
+	CHECK(entry.blocks == NULL && entry.extents == NULL &&
+	    entry.embedded == NULL);
+
+	fclose(cut);
+	fclose(fp);
+}
+
+int
+main(void)
+{
+	test_round_trip();
+	test_mismatch();
+	test_truncated();
+
+	return (test_report());
+}
@@ -0,0 +1,505 @@
+#include "libzdb.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+static int
+plan_io_cmp(const void *a, const void *b)
+{
+	const libzdb_plan_io_t *x = a;
+	const libzdb_plan_io_t *y = b;
+
+	if (x->dev_offset != y->dev_offset) {
+		return (x->dev_offset < y->dev_offset ? -1 : 1);
+	}
+	if (x->file_offset != y->file_offset) {
+		return (x->file_offset < y->file_offset ? -1 : 1);
+	}
+	return (0);
+}
+
+/* plan_piece_t dev of embedded payloads, which are read from no device */
+#define PLAN_EMBEDDED UINT32_MAX
+
+/* a part of an extent chosen to be read */
+typedef struct plan_piece {
+	uint32_t dev;
+	uint64_t dev_offset;
+	uint64_t length;
+	uint64_t file_offset;
+} plan_piece_t;
+
+static inline uint64_t
+extent_end(const libzdb_extent_t *ext)
+{
+	return (ext->file_offset + ext->length);
+}
+
+/* The L0 block of map an extent holds data of */
+static inline const libzdb_block_t *
+extent_block(const libzdb_map_t *map, const libzdb_extent_t *ext)
+{
+	return (&map->blocks[ext->block]);
+}
+
+/* Expected cost of reading length more bytes of dev under policy */
+static uint64_t
+copy_cost(libzdb_copy_policy_t policy, const uint64_t *planned,
+    const uint64_t *latency, uint32_t dev, uint64_t length)
+{
+	const uint64_t bytes = planned[dev] + length;
+
+	if (policy == LIBZDB_COPY_LATENCY && latency) {
+		/* nanoseconds until the read completes */
+		return ((bytes >> 10) * latency[dev] >> 10);
+	}
+	return (bytes);
+}
+
+/*
+ * Choose the part of the file to read next, at pos, among the extents
+ * [lo, hi) holding it, which are the copies of the data at pos. Balancing
+ * policies keep to the device chosen last, dev, up to piece_end so that
+ * each device reads runs of blocks rather than every other block. Returns
+ * the index of the chosen extent.
+ */
+static size_t
+choose_copy(const libzdb_map_t *map, libzdb_copy_policy_t policy,
+    const uint64_t *planned, const uint64_t *latency, size_t lo, size_t hi,
+    uint64_t pos, uint64_t piece_end, uint32_t dev)
+{
+	const libzdb_extent_t *extents = map->extents;
+	size_t ncopies = 0;
+	size_t best = hi;
+	uint64_t best_cost = UINT64_MAX;
+
+	for (size_t i = lo; i < hi; i++) {
+		if (extent_end(&extents[i]) > pos) {
+			if (policy != LIBZDB_COPY_FIRST &&
+			    extents[i].dev == dev) {
+				return (i);
+			}
+			ncopies++;
+		}
+	}
+
+	/* the k-th copy at pos, in map order */
+	size_t k = (pos >> LIBZDB_COPY_ROTOR_SHIFT) % MAX(ncopies, 1);
+
+	for (size_t i = lo; i < hi; i++) {
+		const libzdb_extent_t *ext = &extents[i];
+
+		if (extent_end(ext) <= pos) {
+			continue;
+		}
+
+		switch (policy) {
+		case LIBZDB_COPY_FIRST:
+			if (!(ext->flags & LIBZDB_EXTENT_COPY)) {
+				return (i);
+			}
+			if (best == hi) {
+				best = i;
+			}
+			break;
+		case LIBZDB_COPY_ROTOR:
+			if (k-- == 0) {
+				return (i);
+			}
+			break;
+		default:;
+			const uint64_t length =
+			    MIN(extent_end(ext), piece_end) - pos;
+			const uint64_t cost = copy_cost(
+			    policy, planned, latency, ext->dev, length);
+			if (cost < best_cost) {
+				best = i;
+				best_cost = cost;
+			}
+			break;
+		}
+	}
+
+	return (best);
+}
+
+/* Append a piece to the array *pieces of *npieces, growing it as needed */
+static plan_piece_t *
+piece_add(plan_piece_t **pieces, size_t *npieces, size_t *cap)
+{
+	if (*npieces == *cap) {
+		*cap = *cap ? *cap * 2 : 16;
+		*pieces = realloc(*pieces, *cap * sizeof(plan_piece_t));
+	}
+	return (&(*pieces)[(*npieces)++]);
+}
+
+/*
+ * Choose one copy of each part of the file held by the extents of map,
+ * which are in file order, into a new array *piecesp. Balancing policies
+ * cut extents at rotor boundaries, so there can be more pieces than
+ * extents. Returns the number of pieces.
+ */
+static size_t
+plan_pieces(const libzdb_map_t *map, libzdb_copy_policy_t policy,
+    const uint64_t *latency, uint64_t *planned, plan_piece_t **piecesp)
+{
+	const libzdb_extent_t *extents = map->extents;
+	const size_t nextents = map->nextents;
+	plan_piece_t *pieces = NULL;
+	size_t npieces = 0;
+	size_t cap = 0;
+	size_t lo = 0;
+	uint64_t pos = 0;
+	/* the device chosen for the data before pos, up to chunk_end */
+	uint32_t dev = UINT32_MAX;
+	uint64_t chunk_end = 0;
+
+	while (1) {
+		/* extents before lo end at or before pos */
+		while (lo < nextents && extent_end(&extents[lo]) <= pos) {
+			lo++;
+		}
+		if (lo == nextents) {
+			break;
+		}
+		/* skip a hole */
+		pos = MAX(pos, extents[lo].file_offset);
+
+		size_t hi = lo;
+		while (hi < nextents && extents[hi].file_offset <= pos) {
+			hi++;
+		}
+
+		/*
+		 * Balancing policies switch copies at rotor boundaries so that
+		 * joined extents are still spread across the copies.
+		 */
+		uint64_t piece_end = UINT64_MAX;
+		if (policy != LIBZDB_COPY_FIRST) {
+			piece_end = ((pos >> LIBZDB_COPY_ROTOR_SHIFT) + 1)
+			    << LIBZDB_COPY_ROTOR_SHIFT;
+		}
+
+		if (pos >= chunk_end) {
+			dev = UINT32_MAX;
+			chunk_end = piece_end;
+		}
+
+		const size_t c = choose_copy(map, policy, planned, latency, lo,
+		    hi, pos, piece_end, dev);
+		const libzdb_extent_t *ext = &extents[c];
+		const uint64_t end = MIN(extent_end(ext), piece_end);
+		const uint64_t dev_offset =
+		    ext->dev_offset + (pos - ext->file_offset);
+		plan_piece_t *last = npieces ? &pieces[npieces - 1] : NULL;
+
+		if (ext->flags & LIBZDB_EXTENT_EMBEDDED) {
+			plan_piece_t *piece =
+			    piece_add(&pieces, &npieces, &cap);
+
+			piece->dev = PLAN_EMBEDDED;
+			piece->dev_offset = dev_offset;
+			piece->length = end - pos;
+			piece->file_offset = pos;
+			pos = end;
+			continue;
+		}
+
+		if (last && last->dev == ext->dev &&
+		    last->dev_offset + last->length == dev_offset &&
+		    last->file_offset + last->length == pos) {
+			last->length += end - pos;
+		} else {
+			plan_piece_t *piece =
+			    piece_add(&pieces, &npieces, &cap);
+
+			piece->dev = ext->dev;
+			piece->dev_offset = dev_offset;
+			piece->length = end - pos;
+			piece->file_offset = pos;
+		}
+		planned[ext->dev] += end - pos;
+		dev = ext->dev;
+		pos = end;
+	}
+
+	*piecesp = pieces;
+	return (npieces);
+}
+
+/*
+ * List the compressed blocks of the map of plan, whose extents are in file
+ * order and so are their blocks, and make room for their logical data in
+ * the buffer of the plan.
+ */
+static void
+plan_zblocks(libzdb_plan_t *plan)
+{
+	const libzdb_map_t *map = plan->map;
+	libzdb_plan_zblock_t *last = NULL;
+	size_t cap = 0;
+
+	for (size_t i = 0; i < map->nextents; i++) {
+		const libzdb_extent_t *ext = &map->extents[i];
+
+		if (!(ext->flags & LIBZDB_EXTENT_COMPRESSED)) {
+			continue;
+		}
+
+		/* gang members share the file offset of their block */
+		const libzdb_block_t *info = extent_block(map, ext);
+		const uint64_t file_offset = info->file_offset;
+		if (last && last->file_offset == file_offset) {
+			continue;
+		}
+
+		if (plan->nzblocks == cap) {
+			cap = cap ? cap * 2 : 16;
+			plan->zblocks = realloc(
+			    plan->zblocks, cap * sizeof(libzdb_plan_zblock_t));
+		}
+		last = &plan->zblocks[plan->nzblocks++];
+		last->file_offset = file_offset;
+		last->buf_offset = file_offset - plan->buf_start;
+		last->psize = info->physical_file_data;
+		last->lsize = info->file_data;
+		last->compress = info->compress;
+		plan->buf_end =
+		    MAX(plan->buf_end, file_offset + info->file_data);
+	}
+}
+
+/*
+ * List the blocks of the map of plan whose checksums can be verified. Like
+ * the compressed ones, the extents of each block are consecutive.
+ */
+static void
+plan_cblocks(libzdb_plan_t *plan)
+{
+	const libzdb_map_t *map = plan->map;
+	libzdb_plan_cblock_t *last = NULL;
+	size_t cap = 0;
+
+	for (size_t i = 0; i < map->nextents; i++) {
+		const libzdb_extent_t *ext = &map->extents[i];
+
+		if (!(ext->flags & LIBZDB_EXTENT_CHECKSUM)) {
+			continue;
+		}
+
+		/* each gang member has a checksum of its own data */
+		const libzdb_block_t *info = extent_block(map, ext);
+		const uint64_t file_offset =
+		    info->file_offset + info->gang_offset;
+		if (last && last->file_offset == file_offset) {
+			continue;
+		}
+
+		if (plan->ncblocks == cap) {
+			cap = cap ? cap * 2 : 16;
+			plan->cblocks = realloc(
+			    plan->cblocks, cap * sizeof(libzdb_plan_cblock_t));
+		}
+		last = &plan->cblocks[plan->ncblocks++];
+		last->file_offset = file_offset;
+		last->buf_offset = file_offset - plan->buf_start;
+		last->size = (info->flags & LIBZDB_BLOCK_GANG)
+		    ? info->gang_size
+		    : info->physical_file_data;
+		last->checksum = info->checksum;
+		last->byteswap = (info->flags & LIBZDB_BLOCK_BYTESWAP) != 0;
+		memcpy(last->cksum, info->cksum, sizeof(last->cksum));
+	}
+}
+
+int
+libzdb_plan_build(const libzdb_map_t *map, libzdb_copy_policy_t policy,
+    const uint64_t *latency, libzdb_plan_t **planp)
+{
+	libzdb_plan_t *plan = calloc(1, sizeof(libzdb_plan_t));
+	size_t *count = calloc(map->ndevs + 1, sizeof(size_t));
+	uint64_t *planned = calloc(map->ndevs + 1, sizeof(uint64_t));
+	plan_piece_t *pieces;
+
+	if (!plan || !count || !planned) {
+		free(plan);
+		free(count);
+		free(planned);
+		return (ENOMEM);
+	}
+
+	const size_t npieces =
+	    plan_pieces(map, policy, latency, planned, &pieces);
+
+	plan->map = map;
+	plan->buf_start = npieces ? UINT64_MAX : 0;
+	plan->ios = malloc(MAX(npieces, 1) * sizeof(libzdb_plan_io_t));
+
+	/* group the pieces by device with a counting sort */
+	for (size_t i = 0; i < npieces; i++) {
+		const plan_piece_t *piece = &pieces[i];
+
+		if (piece->dev == PLAN_EMBEDDED) {
+			plan->nembedded++;
+		} else {
+			count[piece->dev + 1]++;
+			plan->nios++;
+		}
+		plan->buf_start = MIN(plan->buf_start, piece->file_offset);
+		plan->buf_end =
+		    MAX(plan->buf_end, piece->file_offset + piece->length);
+	}
+	for (size_t d = 0; d < map->ndevs; d++) {
+		if (count[d + 1]) {
+			plan->ndevs++;
+		}
+		count[d + 1] += count[d];
+	}
+
+	plan->embedded =
+	    malloc(MAX(plan->nembedded, 1) * sizeof(libzdb_plan_io_t));
+	size_t e = 0;
+
+	for (size_t i = 0; i < npieces; i++) {
+		const plan_piece_t *piece = &pieces[i];
+		libzdb_plan_io_t *io = piece->dev == PLAN_EMBEDDED
+		    ? &plan->embedded[e++]
+		    : &plan->ios[count[piece->dev]++];
+
+		io->dev_offset = piece->dev_offset;
+		io->length = piece->length;
+		io->file_offset = piece->file_offset;
+		io->buf_offset = piece->file_offset - plan->buf_start;
+	}
+	free(pieces);
+	free(planned);
+
+	plan_zblocks(plan);
+	plan_cblocks(plan);
+
+	/* count[d] is now the end of the extents of device d */
+	plan->devs = calloc(MAX(plan->ndevs, 1), sizeof(libzdb_plan_dev_t));
+	size_t start = 0;
+	size_t n = 0;
+	for (size_t d = 0; d < map->ndevs; d++) {
+		libzdb_plan_dev_t *dev = &plan->devs[n];
+
+		if (count[d] == start) {
+			continue;
+		}
+
+		dev->dev = d;
+		dev->ios = &plan->ios[start];
+		dev->nios = count[d] - start;
+		qsort(dev->ios, dev->nios, sizeof(libzdb_plan_io_t),
+		    plan_io_cmp);
+		for (size_t i = 0; i < dev->nios; i++) {
+			dev->bytes += dev->ios[i].length;
+		}
+
+		start = count[d];
+		n++;
+	}
+
+	free(count);
+	*planp = plan;
+
+	return (0);
+}
+
+int
+libzdb_plan_write(const libzdb_plan_t *plan, FILE *out)
+{
+	const libzdb_map_t *map = plan->map;
+
+	fprintf(out, "file size: %lu (%zu devices, %zu extents)\n",
+	    map->file_size, plan->ndevs, plan->nios);
+	fprintf(out, "buffer: [%lu, %lu)\n", plan->buf_start, plan->buf_end);
+
+	for (size_t d = 0; d < plan->ndevs; d++) {
+		const libzdb_plan_dev_t *dev = &plan->devs[d];
+
+		fprintf(out, "dev=%s extents=%zu size=%lu\n",
+		    map->devs[dev->dev], dev->nios, dev->bytes);
+		for (size_t i = 0; i < dev->nios; i++) {
+			const libzdb_plan_io_t *io = &dev->ios[i];
+
+			fprintf(out,
+			    "    offset=%lu size=%lu file_offset=%lu "
+			    "buf_offset=%lu\n",
+			    io->dev_offset, io->length, io->file_offset,
+			    io->buf_offset);
+		}
+	}
+
+	for (size_t i = 0; i < plan->nembedded; i++) {
+		const libzdb_plan_io_t *io = &plan->embedded[i];
+
+		fprintf(out,
+		    "embedded offset=%lu size=%lu file_offset=%lu "
+		    "buf_offset=%lu\n",
+		    io->dev_offset, io->length, io->file_offset,
+		    io->buf_offset);
+	}
+
+	for (size_t z = 0; z < plan->nzblocks; z++) {
+		const libzdb_plan_zblock_t *zb = &plan->zblocks[z];
+
+		fprintf(out,
+		    "compressed file_offset=%lu buf_offset=%lu psize=%u "
+		    "lsize=%u compress=%u\n",
+		    zb->file_offset, zb->buf_offset, zb->psize, zb->lsize,
+		    zb->compress);
+	}
+
+	for (size_t c = 0; c < plan->ncblocks; c++) {
+		const libzdb_plan_cblock_t *cb = &plan->cblocks[c];
+
+		fprintf(out,
+		    "checksum file_offset=%lu buf_offset=%lu size=%u "
+		    "checksum=%u byteswap=%u cksum=%lx:%lx:%lx:%lx\n",
+		    cb->file_offset, cb->buf_offset, cb->size, cb->checksum,
+		    cb->byteswap, cb->cksum[0], cb->cksum[1], cb->cksum[2],
+		    cb->cksum[3]);
+	}
+
+	return (ferror(out) ? EIO : 0);
+}
+
+void
+libzdb_latency_update(
+    uint64_t *latency, uint32_t dev, uint64_t length, uint64_t ns)
+{
+	if (length == 0) {
+		return;
+	}
+
+	const uint64_t sample = (ns << 20) / length;
+
+	/* weigh the new sample by 1/8, as TCP does its round-trip time */
+	if (latency[dev] == 0) {
+		latency[dev] = sample;
+	} else if (sample > latency[dev]) {
+		latency[dev] += (sample - latency[dev]) >> 3;
+	} else {
+		latency[dev] -= (latency[dev] - sample) >> 3;
+	}
+}
+
+void
+libzdb_plan_free(libzdb_plan_t *plan)
+{
+	if (!plan) {
+		return;
+	}
+
+	free(plan->devs);
+	free(plan->ios);
+	free(plan->zblocks);
+	free(plan->cblocks);
+	free(plan->embedded);
+	free(plan);
+}
@@ -0,0 +1,274 @@
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static int
+io_file_cmp(const void *a, const void *b)
+{
+	const libzdb_plan_io_t *x = a;
+	const libzdb_plan_io_t *y = b;
+
+	if (x->file_offset != y->file_offset) {
+		return (x->file_offset < y->file_offset ? -1 : 1);
+	}
+	return (0);
+}
+
+/* Every byte of the file is read once, at its place in the buffer */
+static void
+check_cover(const libzdb_plan_t *plan, uint64_t file_size)
+{
+	libzdb_plan_io_t *ios = malloc(plan->nios * sizeof(libzdb_plan_io_t));
+	uint64_t pos = 0;
+
+	memcpy(ios, plan->ios, plan->nios * sizeof(libzdb_plan_io_t));
+	qsort(ios, plan->nios, sizeof(libzdb_plan_io_t), io_file_cmp);
+	CHECK(plan->buf_start == 0 && plan->buf_end == file_size);
+	for (size_t i = 0; i < plan->nios; i++) {
+		CHECK(ios[i].file_offset == pos);
+		CHECK(ios[i].buf_offset == ios[i].file_offset);
+		CHECK(ios[i].dev_offset == 4 * MiB + ios[i].file_offset);
+		pos = ios[i].file_offset + ios[i].length;
+	}
+	CHECK(pos == file_size);
+
+	free(ios);
+}
+
+/*
+ * Balancing policies switch copies every 2 MiB, cutting a single extent
+ * into more reads than the map has extents
+ */
+static void
+test_mirror_balanced(libzdb_copy_policy_t policy)
+{
+	const uint64_t latency[] = {1000, 1000};
+	libzdb_block_t block;
+	libzdb_extent_t extents[2];
+	libzdb_map_t map;
+	libzdb_plan_t *plan;
+
+	test_make_mirror(&map, &block, extents);
+	CHECK(libzdb_plan_build(&map, policy, latency, &plan) == 0);
+
+	CHECK(plan->nios == (16 * MiB) >> LIBZDB_COPY_ROTOR_SHIFT);
+	CHECK(plan->ndevs == 2);
+	for (size_t d = 0; d < plan->ndevs; d++) {
+		CHECK(plan->devs[d].bytes == 8 * MiB);
+	}
+	check_cover(plan, map.file_size);
+
+	libzdb_plan_free(plan);
+}
+
+/* The first copy is read whole */
+static void
+test_mirror_first(void)
+{
+	libzdb_block_t block;
+	libzdb_extent_t extents[2];
+	libzdb_map_t map;
+	libzdb_plan_t *plan;
+
+	test_make_mirror(&map, &block, extents);
+	CHECK(libzdb_plan_build(&map, LIBZDB_COPY_FIRST, NULL, &plan) == 0);
+
+	CHECK(plan->nios == 1);
+	CHECK(plan->ndevs == 1 && plan->devs[0].dev == 0);
+	check_cover(plan, map.file_size);
+
+	libzdb_plan_free(plan);
+}
+
+/*
+ * Two 128K blocks on the raidz vdev, each split between its two data
+ * columns, the second block following the first on every device
+ */
+static void
+make_raidz(libzdb_map_t *map, libzdb_block_t *blocks, libzdb_extent_t *extents)
+{
+	test_map_init(map, 2 * 131072);
+
+	memset(blocks, 0, 2 * sizeof(libzdb_block_t));
+	for (int b = 0; b < 2; b++) {
+		blocks[b].file_offset = b * 131072;
+		blocks[b].file_data = 131072;
+		blocks[b].physical_file_data = 131072;
+		blocks[b].vdev = 2;
+		blocks[b].offset = b * 196608;
+		blocks[b].actual_size = 131072;
+		blocks[b].ndvas = 1;
+		blocks[b].flags = LIBZDB_BLOCK_CHECKSUM;
+		blocks[b].checksum = 7;
+	}
+	map->blocks = blocks;
+	map->nblocks = 2;
+
+	memset(extents, 0, 4 * sizeof(libzdb_extent_t));
+	for (int i = 0; i < 4; i++) {
+		const int b = i / 2;
+		const int col = 1 + i % 2;
+
+		extents[i].file_offset = i * 65536;
+		extents[i].dev_offset = 4 * MiB + b * 65536;
+		extents[i].length = 65536;
+		extents[i].dev = TEST_RAIDZ_DEV + col;
+		extents[i].flags = LIBZDB_EXTENT_RAIDZ | LIBZDB_EXTENT_CHECKSUM;
+		extents[i].block = b;
+		extents[i].child = col;
+		extents[i].col = col;
+	}
+	map->extents = extents;
+	map->nextents = 4;
+}
+
+/*
+ * The columns of a raidz block have no copies to choose among: each data
+ * column is read once, in device order, whatever the policy
+ */
+static void
+test_raidz(libzdb_copy_policy_t policy)
+{
+	libzdb_block_t blocks[2];
+	libzdb_extent_t extents[4];
+	libzdb_map_t map;
+	libzdb_plan_t *plan;
+
+	make_raidz(&map, blocks, extents);
+	CHECK(libzdb_plan_build(&map, policy, NULL, &plan) == 0);
+
+	CHECK(plan->nios == 4 && plan->nembedded == 0);
+	CHECK(plan->buf_start == 0 && plan->buf_end == map.file_size);
+	CHECK(plan->ndevs == 2);
+	for (size_t d = 0; d < plan->ndevs; d++) {
+		const libzdb_plan_dev_t *dev = &plan->devs[d];
+
+		CHECK(dev->dev == TEST_RAIDZ_DEV + 1 + d);
+		CHECK(dev->nios == 2 && dev->bytes == 131072);
+		for (size_t i = 0; i < dev->nios; i++) {
+			const libzdb_plan_io_t *io = &dev->ios[i];
+
+			CHECK(io->dev_offset == 4 * MiB + i * 65536);
+			CHECK(io->file_offset == (2 * i + d) * 65536);
+			CHECK(io->buf_offset == io->file_offset);
+			CHECK(io->length == 65536);
+		}
+	}
+
+	/* the columns of each block are checked as one */
+	CHECK(plan->nzblocks == 0);
+	CHECK(plan->ncblocks == 2);
+	for (size_t c = 0; c < plan->ncblocks; c++) {
+		CHECK(plan->cblocks[c].file_offset == c * 131072);
+		CHECK(plan->cblocks[c].size == 131072);
+		CHECK(plan->cblocks[c].checksum == 7);
+	}
+
+	libzdb_plan_free(plan);
+}
+
+/*
+ * A plain 128K block followed by one compressed to 16K, both on the single
+ * disk vdev and next to each other
+ */
+static void
+make_compressed(
+    libzdb_map_t *map, libzdb_block_t *blocks, libzdb_extent_t *extents)
+{
+	test_map_init(map, 2 * 131072);
+
+	memset(blocks, 0, 2 * sizeof(libzdb_block_t));
+	for (int b = 0; b < 2; b++) {
+		blocks[b].file_offset = b * 131072;
+		blocks[b].file_data = 131072;
+		blocks[b].vdev = 1;
+		blocks[b].offset = b * 131072;
+		blocks[b].ndvas = 1;
+		blocks[b].flags = LIBZDB_BLOCK_CHECKSUM;
+		blocks[b].checksum = 7;
+	}
+	blocks[0].physical_file_data = 131072;
+	blocks[0].actual_size = 131072;
+	blocks[1].physical_file_data = 16384;
+	blocks[1].actual_size = 16384;
+	blocks[1].compress = 15;
+	map->blocks = blocks;
+	map->nblocks = 2;
+
+	memset(extents, 0, 2 * sizeof(libzdb_extent_t));
+	for (int i = 0; i < 2; i++) {
+		extents[i].file_offset = blocks[i].file_offset;
+		extents[i].dev_offset = 4 * MiB + blocks[i].offset;
+		extents[i].length = blocks[i].physical_file_data;
+		extents[i].dev = 2;
+		extents[i].flags = LIBZDB_EXTENT_CHECKSUM;
+		extents[i].block = i;
+	}
+	extents[1].flags |= LIBZDB_EXTENT_COMPRESSED;
+	map->extents = extents;
+	map->nextents = 2;
+}
+
+/*
+ * Compressed data is read to the start of the room for its logical data,
+ * which the buffer of the plan extends to hold
+ */
+static void
+test_compressed(void)
+{
+	libzdb_block_t blocks[2];
+	libzdb_extent_t extents[2];
+	libzdb_map_t map;
+	libzdb_plan_t *plan;
+
+	make_compressed(&map, blocks, extents);
+	CHECK(libzdb_plan_build(&map, LIBZDB_COPY_FIRST, NULL, &plan) == 0);
+
+	/* the compressed data follows the plain block on the device */
+	CHECK(plan->nios == 1 && plan->ndevs == 1);
+	CHECK(plan->ios[0].dev_offset == 4 * MiB);
+	CHECK(plan->ios[0].length == 131072 + 16384);
+	CHECK(plan->buf_start == 0 && plan->buf_end == 2 * 131072);
+
+	CHECK(plan->nzblocks == 1);
+	CHECK(plan->zblocks[0].file_offset == 131072);
+	CHECK(plan->zblocks[0].buf_offset == 131072);
+	CHECK(plan->zblocks[0].psize == 16384);
+	CHECK(plan->zblocks[0].lsize == 131072);
+	CHECK(plan->zblocks[0].compress == 15);
+
+	/* the checksum of a compressed block covers its compressed data */
+	CHECK(plan->ncblocks == 2);
+	CHECK(plan->cblocks[0].file_offset == 0);
+	CHECK(plan->cblocks[0].size == 131072);
+	CHECK(plan->cblocks[1].file_offset == 131072);
+	CHECK(plan->cblocks[1].buf_offset == 131072);
+	CHECK(plan->cblocks[1].size == 16384);
+	libzdb_plan_free(plan);
+
+	/* the buffer of a part of the file starts at its first block */
+	map.extents = &extents[1];
+	map.nextents = 1;
+	CHECK(libzdb_plan_build(&map, LIBZDB_COPY_FIRST, NULL, &plan) == 0);
+
+	CHECK(plan->nios == 1 && plan->ios[0].buf_offset == 0);
+	CHECK(plan->buf_start == 131072 && plan->buf_end == 2 * 131072);
+	CHECK(plan->nzblocks == 1 && plan->zblocks[0].buf_offset == 0);
+	CHECK(plan->ncblocks == 1 && plan->cblocks[0].buf_offset == 0);
+	libzdb_plan_free(plan);
+}
+
+int
+main(void)
+{
+	test_mirror_balanced(LIBZDB_COPY_ROTOR);
+	test_mirror_balanced(LIBZDB_COPY_LEAST_LOADED);
+	test_mirror_balanced(LIBZDB_COPY_LATENCY);
+	test_mirror_first();
+	test_raidz(LIBZDB_COPY_FIRST);
+	test_raidz(LIBZDB_COPY_ROTOR);
+	test_compressed();
+
+	return (test_report());
+}
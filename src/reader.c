@@ -0,0 +1,634 @@
+#include "libzdb.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/abd.h>
+#include <sys/zfs_context.h>
+#include <sys/zio_checksum.h>
+#include <sys/zio_compress.h>
+
+#ifdef HAVE_LIBURING
+
+#include <fcntl.h>
+#include <liburing.h>
+#include <unistd.h>
+
+/* O_DIRECT alignment of device offsets, lengths and buffers */
+#define READER_ALIGN 4096
+
+/* Compressed blocks decompressed per task */
+#define READER_ZBLOCKS 64
+
+/*
+ * A device of a reader, opened by the first read that needs it. Its ring
+ * and buffers serve one read at a time: lock is held by the task reading
+ * the device, from the lazy opening until its last read completes.
+ */
+typedef struct reader_dev {
+	kmutex_t lock;
+	boolean_t opened;
+	int err; /* of the opening, the device is not used if set */
+	int fd;
+	struct io_uring ring;
+	boolean_t ring_ready;
+	/*
+	 * depth buffers of bufsize bytes, one per read in flight, and
+	 * whether the buffers and fd are registered with the ring
+	 */
+	uint8_t *bufs;
+	boolean_t fixed_bufs;
+	boolean_t fixed_file;
+} reader_dev_t;
+
+struct libzdb_reader {
+	uint64_t pool_guid;
+	reader_dev_t *devs; /* indexed like the device table of the pool */
+	size_t ndevs;
+	uint32_t depth;
+	size_t bufsize;
+	taskq_t *tq;
+	boolean_t verify;
+	taskq_t *vtq; /* verifies checksums while the devices are read */
+};
+
+struct reader_check;
+
+/* The checksum verification of the blocks of a plan during one read */
+typedef struct reader_verify {
+	taskq_t *tq;
+	const libzdb_plan_t *plan;
+	uint8_t *buf;
+	struct reader_check *checks; /* indexed like plan->cblocks */
+	/* templates of the salted checksums, e.g. skein */
+	void *tmpls[ZIO_CHECKSUM_FUNCTIONS];
+} reader_verify_t;
+
+/* A block to verify once the pending bytes of its data are read */
+typedef struct reader_check {
+	reader_verify_t *verify;
+	uint64_t pending;
+	int err;
+} reader_check_t;
+
+/*
+ * A read of [start, end) of a device into a ring buffer, feeding the plan
+ * reads of the device from first on that overlap it
+ */
+typedef struct reader_span {
+	uint64_t start;
+	uint64_t end;
+	size_t first;
+	hrtime_t issued;
+} reader_span_t;
+
+/* The reads of one device of a plan, or a run of blocks to decompress */
+typedef struct reader_task {
+	libzdb_reader_t *reader;
+	const libzdb_plan_t *plan;
+	const libzdb_plan_dev_t *pdev;
+	size_t first; /* zblocks [first, last) */
+	size_t last;
+	uint8_t *buf;
+	uint64_t *latency;
+	reader_verify_t *verify; /* NULL if checksums are not verified */
+	int err;
+} reader_task_t;
+
+static inline uint64_t
+io_end(const libzdb_plan_io_t *io)
+{
+	return (io->dev_offset + io->length);
+}
+
+/*
+ * Cut the next span of up to bufsize bytes out of the reads of pdev, from
+ * device offset *pos and read *next on. Reads that are contiguous once
+ * aligned are merged, longer ones are split. Returns B_FALSE once every
+ * read is covered.
+ */
+static boolean_t
+span_next(const libzdb_reader_t *reader, const libzdb_plan_dev_t *pdev,
+    size_t *next, uint64_t *pos, reader_span_t *span)
+{
+	const libzdb_plan_io_t *ios = pdev->ios;
+	size_t i = *next;
+
+	while (i < pdev->nios && io_end(&ios[i]) <= *pos) {
+		i++;
+	}
+	*next = i;
+	if (i == pdev->nios) {
+		return (B_FALSE);
+	}
+
+	/* *pos is aligned, bytes before it were read by the previous span */
+	span->first = i;
+	span->start = MAX(*pos, P2ALIGN(ios[i].dev_offset, READER_ALIGN));
+	span->end = span->start;
+	for (; i < pdev->nios; i++) {
+		const uint64_t end = P2ROUNDUP(io_end(&ios[i]), READER_ALIGN);
+
+		if (P2ALIGN(ios[i].dev_offset, READER_ALIGN) > span->end) {
+			break;
+		}
+		span->end = MAX(span->end,
+		    MIN(end, span->start + reader->bufsize));
+		if (end > span->start + reader->bufsize) {
+			break;
+		}
+	}
+	*pos = span->end;
+
+	return (B_TRUE);
+}
+
+/* Whether the data of blocks with a given checksum can be verified */
+static boolean_t
+checksum_verifiable(uint32_t checksum)
+{
+	return (checksum < ZIO_CHECKSUM_FUNCTIONS &&
+	    zio_checksum_table[checksum].ci_func[0] != NULL &&
+	    !(zio_checksum_table[checksum].ci_flags &
+		ZCHECKSUM_FLAG_EMBEDDED));
+}
+
+/* Check the data of a block of a plan, now read, against its checksum */
+static void
+verify_task(void *arg)
+{
+	reader_check_t *check = arg;
+	reader_verify_t *verify = check->verify;
+	const libzdb_plan_cblock_t *cb =
+	    &verify->plan->cblocks[check - verify->checks];
+	zio_cksum_t expected, actual;
+
+	if (!checksum_verifiable(cb->checksum)) {
+		return;
+	}
+
+	/* as zio_checksum_error_impl() does for foreign byte order */
+	abd_t *abd = abd_get_from_buf(verify->buf + cb->buf_offset, cb->size);
+	zio_checksum_table[cb->checksum].ci_func[cb->byteswap](
+	    abd, cb->size, verify->tmpls[cb->checksum], &actual);
+	abd_put(abd);
+
+	ZIO_SET_CHECKSUM(&expected, cb->cksum[0], cb->cksum[1], cb->cksum[2],
+	    cb->cksum[3]);
+	if (!ZIO_CHECKSUM_EQUAL(actual, expected)) {
+		fprintf(stderr,
+		    "checksum mismatch in the block at offset %llu\n",
+		    (u_longlong_t) cb->file_offset);
+		check->err = ECKSUM;
+	}
+}
+
+/*
+ * Count the bytes [lo, hi) of the buffer of a plan as read, and dispatch
+ * the verification of every block whose data is now read whole
+ */
+static void
+verify_copied(reader_verify_t *verify, uint64_t lo, uint64_t hi)
+{
+	const libzdb_plan_cblock_t *cblocks = verify->plan->cblocks;
+	const size_t ncblocks = verify->plan->ncblocks;
+	size_t l = 0;
+	size_t h = ncblocks;
+
+	/* blocks do not overlap, so the first one ending after lo */
+	while (l < h) {
+		const size_t m = l + (h - l) / 2;
+
+		if (cblocks[m].buf_offset + cblocks[m].size <= lo) {
+			l = m + 1;
+		} else {
+			h = m;
+		}
+	}
+
+	for (size_t c = l; c < ncblocks && cblocks[c].buf_offset < hi; c++) {
+		const uint64_t start = MAX(lo, cblocks[c].buf_offset);
+		const uint64_t end =
+		    MIN(hi, cblocks[c].buf_offset + cblocks[c].size);
+		reader_check_t *check = &verify->checks[c];
+
+		if (atomic_add_64_nv(&check->pending,
+			-(int64_t) (end - start)) == 0) {
+			VERIFY(taskq_dispatch(verify->tq, verify_task, check,
+				   TQ_SLEEP) != 0);
+		}
+	}
+}
+
+/* Scatter the data of a span read into data to the plan reads it feeds */
+static void
+span_copy(const libzdb_plan_dev_t *pdev, const reader_span_t *span,
+    const uint8_t *data, uint8_t *buf, reader_verify_t *verify)
+{
+	const libzdb_plan_io_t *ios = pdev->ios;
+
+	for (size_t i = span->first;
+	     i < pdev->nios && ios[i].dev_offset < span->end; i++) {
+		const uint64_t lo = MAX(ios[i].dev_offset, span->start);
+		const uint64_t hi = MIN(io_end(&ios[i]), span->end);
+		const uint64_t buf_offset =
+		    ios[i].buf_offset + (lo - ios[i].dev_offset);
+
+		if (lo < hi) {
+			memcpy(buf + buf_offset, data + (lo - span->start),
+			    hi - lo);
+			if (verify) {
+				verify_copied(
+				    verify, buf_offset, buf_offset + hi - lo);
+			}
+		}
+	}
+}
+
+/* Release what reader_dev_open() set up, be it all or part */
+static void
+reader_dev_close(reader_dev_t *rd)
+{
+	if (rd->ring_ready) {
+		io_uring_queue_exit(&rd->ring);
+		rd->ring_ready = B_FALSE;
+	}
+	if (rd->fd != -1) {
+		close(rd->fd);
+		rd->fd = -1;
+	}
+	free(rd->bufs);
+	rd->bufs = NULL;
+}
+
+/*
+ * Open a device for direct reads with a ring of depth entries and as many
+ * buffers. Buffers and fd are registered with the ring when possible:
+ * registered buffers count against RLIMIT_MEMLOCK.
+ */
+static int
+reader_dev_open(reader_dev_t *rd, const char *path, uint32_t depth,
+    size_t bufsize)
+{
+	void *bufs;
+	int err;
+
+	rd->fd = open(path, O_RDONLY | O_DIRECT);
+	if (rd->fd == -1) {
+		return (errno);
+	}
+
+	err = posix_memalign(&bufs, READER_ALIGN, depth * bufsize);
+	if (err != 0) {
+		return (err);
+	}
+	rd->bufs = bufs;
+
+	err = io_uring_queue_init(depth, &rd->ring, 0);
+	if (err < 0) {
+		return (-err);
+	}
+	rd->ring_ready = B_TRUE;
+
+	struct iovec *iov = malloc(depth * sizeof(struct iovec));
+	for (uint32_t s = 0; s < depth; s++) {
+		iov[s].iov_base = rd->bufs + s * bufsize;
+		iov[s].iov_len = bufsize;
+	}
+	rd->fixed_bufs = io_uring_register_buffers(&rd->ring, iov, depth) == 0;
+	rd->fixed_file = io_uring_register_files(&rd->ring, &rd->fd, 1) == 0;
+	free(iov);
+
+	return (0);
+}
+
+/*
+ * Stream the reads of one device of a plan through its ring, keeping up to
+ * depth spans in flight
+ */
+static void
+reader_dev_task(void *arg)
+{
+	reader_task_t *task = arg;
+	libzdb_reader_t *reader = task->reader;
+	const libzdb_plan_dev_t *pdev = task->pdev;
+	const char *path = task->plan->map->devs[pdev->dev];
+	reader_dev_t *rd = &reader->devs[pdev->dev];
+	reader_span_t *spans;
+	uint32_t *idle;
+	uint32_t nidle = reader->depth;
+	size_t next = 0;
+	uint64_t pos = 0;
+
+	/* concurrent reads of the reader take turns on the device */
+	mutex_enter(&rd->lock);
+	if (!rd->opened) {
+		rd->opened = B_TRUE;
+		rd->err = reader_dev_open(
+		    rd, path, reader->depth, reader->bufsize);
+		if (rd->err) {
+			reader_dev_close(rd);
+		}
+	}
+	if (rd->err) {
+		fprintf(stderr, "cannot open '%s': %s\n", path,
+		    strerror(rd->err));
+		task->err = rd->err;
+		mutex_exit(&rd->lock);
+		return;
+	}
+
+	spans = malloc(reader->depth * sizeof(reader_span_t));
+	idle = malloc(reader->depth * sizeof(uint32_t));
+	for (uint32_t s = 0; s < reader->depth; s++) {
+		idle[s] = s;
+	}
+
+	for (;;) {
+		/* keep the ring full unless a read failed */
+		while (task->err == 0 && nidle > 0 &&
+		    span_next(reader, pdev, &next, &pos, &spans[idle[0]])) {
+			const uint32_t s = idle[0];
+			reader_span_t *span = &spans[s];
+			uint8_t *data = rd->bufs + s * reader->bufsize;
+			const int fd = rd->fixed_file ? 0 : rd->fd;
+			struct io_uring_sqe *sqe = io_uring_get_sqe(&rd->ring);
+
+			idle[0] = idle[--nidle];
+			if (rd->fixed_bufs) {
+				io_uring_prep_read_fixed(sqe, fd, data,
+				    span->end - span->start, span->start, s);
+			} else {
+				io_uring_prep_read(sqe, fd, data,
+				    span->end - span->start, span->start);
+			}
+			if (rd->fixed_file) {
+				sqe->flags |= IOSQE_FIXED_FILE;
+			}
+			io_uring_sqe_set_data(sqe, (void *) (uintptr_t) s);
+			span->issued = gethrtime();
+		}
+
+		if (nidle == reader->depth) {
+			break;
+		}
+
+		struct io_uring_cqe *cqe;
+		int err = io_uring_submit_and_wait(&rd->ring, 1);
+		if (err < 0 && err != -EINTR) {
+			/* nothing can be reaped from a broken ring */
+			task->err = -err;
+			rd->err = task->err;
+			break;
+		}
+
+		while (io_uring_peek_cqe(&rd->ring, &cqe) == 0) {
+			const uint32_t s =
+			    (uintptr_t) io_uring_cqe_get_data(cqe);
+			const reader_span_t *span = &spans[s];
+			const int res = cqe->res;
+
+			io_uring_cqe_seen(&rd->ring, cqe);
+			idle[nidle++] = s;
+
+			if (res < 0) {
+				task->err = task->err ? task->err : -res;
+			} else if ((uint64_t) res != span->end - span->start) {
+				task->err = task->err ? task->err : EIO;
+			} else if (task->err == 0) {
+				if (task->latency) {
+					libzdb_latency_update(task->latency,
+					    pdev->dev, res,
+					    gethrtime() - span->issued);
+				}
+				span_copy(pdev, span,
+				    rd->bufs + s * reader->bufsize, task->buf,
+				    task->verify);
+			}
+		}
+	}
+
+	mutex_exit(&rd->lock);
+
+	if (task->err) {
+		fprintf(stderr, "cannot read '%s': %s\n", path,
+		    strerror(task->err));
+	}
+
+	free(idle);
+	free(spans);
+}
+
+/*
+ * Decompress a run of compressed blocks of a plan in place, each from a
+ * copy of its compressed data
+ */
+static void
+reader_zblock_task(void *arg)
+{
+	reader_task_t *task = arg;
+	const libzdb_plan_t *plan = task->plan;
+	uint8_t *src = NULL;
+	size_t cap = 0;
+
+	for (size_t i = task->first; i < task->last && !task->err; i++) {
+		const libzdb_plan_zblock_t *zb = &plan->zblocks[i];
+		uint8_t *dst = task->buf + zb->buf_offset;
+
+		if (zb->psize > cap) {
+			cap = zb->psize;
+			src = realloc(src, cap);
+		}
+		memcpy(src, dst, zb->psize);
+		if (zio_decompress_data_buf(zb->compress, src, dst, zb->psize,
+			zb->lsize) != 0) {
+			fprintf(stderr,
+			    "cannot decompress the block at offset %llu\n",
+			    (u_longlong_t) zb->file_offset);
+			task->err = EIO;
+		}
+	}
+
+	free(src);
+}
+
+int
+libzdb_reader_open(const libzdb_map_t *map, uint32_t depth, size_t bufsize,
+    libzdb_reader_t **readerp)
+{
+	libzdb_reader_t *reader = calloc(1, sizeof(libzdb_reader_t));
+
+	reader->pool_guid = map->pool_guid;
+	reader->depth = depth ? depth : LIBZDB_READER_DEPTH;
+	reader->bufsize = P2ROUNDUP(
+	    bufsize ? bufsize : LIBZDB_READER_BUFSIZE, READER_ALIGN);
+	reader->ndevs = map->ndevs;
+	reader->devs = calloc(MAX(map->ndevs, 1), sizeof(reader_dev_t));
+	for (size_t i = 0; i < reader->ndevs; i++) {
+		mutex_init(&reader->devs[i].lock, NULL, MUTEX_DEFAULT, NULL);
+	}
+
+	reader->tq = taskq_create("libzdb_reader", MAX(map->ndevs, 1),
+	    defclsyspri, MAX(map->ndevs, 1), INT_MAX, TASKQ_PREPOPULATE);
+	reader->verify = B_TRUE;
+	reader->vtq = taskq_create("libzdb_verify",
+	    MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), defclsyspri, 1, INT_MAX,
+	    TASKQ_PREPOPULATE);
+
+	*readerp = reader;
+	return (0);
+}
+
+int
+libzdb_reader_read(libzdb_reader_t *reader, const libzdb_plan_t *plan,
+    void *buf, uint64_t *latency)
+{
+	const libzdb_map_t *map = plan->map;
+	const size_t nzruns = (plan->nzblocks + READER_ZBLOCKS - 1) /
+	    READER_ZBLOCKS;
+	reader_task_t *tasks =
+	    calloc(MAX(plan->ndevs + nzruns, 1), sizeof(reader_task_t));
+	reader_verify_t verify = {reader->vtq, plan, buf, NULL, {NULL}};
+	int err = 0;
+
+	if (map->pool_guid != reader->pool_guid ||
+	    map->ndevs != reader->ndevs) {
+		free(tasks);
+		return (EXDEV);
+	}
+
+	if (reader->verify && plan->ncblocks) {
+		zio_cksum_salt_t salt;
+
+		memcpy(salt.zcs_bytes, map->cksum_salt, sizeof(salt.zcs_bytes));
+		verify.checks = calloc(plan->ncblocks, sizeof(reader_check_t));
+		for (size_t c = 0; c < plan->ncblocks; c++) {
+			const uint32_t checksum = plan->cblocks[c].checksum;
+
+			verify.checks[c].verify = &verify;
+			verify.checks[c].pending = plan->cblocks[c].size;
+			if (checksum_verifiable(checksum) &&
+			    verify.tmpls[checksum] == NULL &&
+			    zio_checksum_table[checksum].ci_tmpl_init != NULL) {
+				verify.tmpls[checksum] =
+				    zio_checksum_table[checksum].ci_tmpl_init(
+					&salt);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < plan->ndevs; i++) {
+		reader_task_t *task = &tasks[i];
+
+		task->reader = reader;
+		task->plan = plan;
+		task->pdev = &plan->devs[i];
+		task->buf = buf;
+		task->latency = latency;
+		task->verify = verify.checks ? &verify : NULL;
+		VERIFY(taskq_dispatch(reader->tq, reader_dev_task, task,
+			   TQ_SLEEP) != 0);
+	}
+
+	/* embedded payloads come with the map */
+	for (size_t i = 0; i < plan->nembedded; i++) {
+		const libzdb_plan_io_t *io = &plan->embedded[i];
+
+		memcpy((uint8_t *) buf + io->buf_offset,
+		    map->embedded + io->dev_offset, io->length);
+	}
+
+	taskq_wait(reader->tq);
+	for (size_t i = 0; i < plan->ndevs && !err; i++) {
+		err = tasks[i].err;
+	}
+
+	/* the device tasks dispatched every verification before they ended */
+	if (verify.checks) {
+		taskq_wait(reader->vtq);
+		for (size_t c = 0; c < plan->ncblocks && !err; c++) {
+			err = verify.checks[c].err;
+		}
+		for (int t = 0; t < ZIO_CHECKSUM_FUNCTIONS; t++) {
+			if (verify.tmpls[t] != NULL) {
+				zio_checksum_table[t].ci_tmpl_free(
+				    verify.tmpls[t]);
+			}
+		}
+		free(verify.checks);
+	}
+
+	/* every part of a compressed block is read before it is decompressed */
+	for (size_t r = 0; r < nzruns && !err; r++) {
+		reader_task_t *task = &tasks[plan->ndevs + r];
+
+		task->plan = plan;
+		task->first = r * READER_ZBLOCKS;
+		task->last = MIN(task->first + READER_ZBLOCKS, plan->nzblocks);
+		task->buf = buf;
+		VERIFY(taskq_dispatch(reader->tq, reader_zblock_task, task,
+			   TQ_SLEEP) != 0);
+	}
+	taskq_wait(reader->tq);
+	for (size_t r = 0; r < nzruns && !err; r++) {
+		err = tasks[plan->ndevs + r].err;
+	}
+
+	free(tasks);
+	return (err);
+}
+
+void
+libzdb_reader_set_verify(libzdb_reader_t *reader, int verify)
+{
+	reader->verify = verify ? B_TRUE : B_FALSE;
+}
+
+void
+libzdb_reader_close(libzdb_reader_t *reader)
+{
+	if (!reader) {
+		return;
+	}
+
+	taskq_destroy(reader->tq);
+	taskq_destroy(reader->vtq);
+	for (size_t i = 0; i < reader->ndevs; i++) {
+		if (reader->devs[i].opened) {
+			reader_dev_close(&reader->devs[i]);
+		}
+		mutex_destroy(&reader->devs[i].lock);
+	}
+	free(reader->devs);
+	free(reader);
+}
+
+#else /* HAVE_LIBURING */
+
+/* Built without liburing: direct reads are not supported */
+
+int
+libzdb_reader_open(const libzdb_map_t *map, uint32_t depth, size_t bufsize,
+    libzdb_reader_t **readerp)
+{
+	return (ENOTSUP);
+}
+
+int
+libzdb_reader_read(libzdb_reader_t *reader, const libzdb_plan_t *plan,
+    void *buf, uint64_t *latency)
+{
+	return (ENOTSUP);
+}
+
+void
+libzdb_reader_set_verify(libzdb_reader_t *reader, int verify)
+{
+}
+
+void
+libzdb_reader_close(libzdb_reader_t *reader)
+{
+}
+
+#endif /* HAVE_LIBURING */
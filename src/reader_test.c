@@ -0,0 +1,111 @@
+#include "test.h"
+
+#include <stdlib.h>
+#include <sys/zfs_context.h>
+
+/*
+ * Two blocks embedded in their block pointers, at the start of the file and
+ * at its second record, with a hole between them
+ */
+static void
+make_embedded(libzdb_map_t *map, libzdb_block_t *blocks,
+    libzdb_extent_t *extents, uint8_t *embedded)
+{
+	test_map_init(map, 131072 + 60);
+
+	memset(blocks, 0, 2 * sizeof(libzdb_block_t));
+	blocks[0].file_offset = 0;
+	blocks[0].file_data = 512;
+	blocks[0].physical_file_data = 100;
+	blocks[0].actual_size = 100;
+	blocks[0].offset = 0;
+	blocks[0].flags = LIBZDB_BLOCK_EMBEDDED;
+	blocks[1] = blocks[0];
+	blocks[1].file_offset = 131072;
+	blocks[1].file_data = 60;
+	blocks[1].physical_file_data = 60;
+	blocks[1].actual_size = 60;
+	blocks[1].offset = 100;
+	map->blocks = blocks;
+	map->nblocks = 2;
+
+	memset(extents, 0, 2 * sizeof(libzdb_extent_t));
+	for (int i = 0; i < 2; i++) {
+		extents[i].file_offset = blocks[i].file_offset;
+		extents[i].dev_offset = blocks[i].offset;
+		extents[i].length = blocks[i].actual_size;
+		extents[i].flags = LIBZDB_EXTENT_EMBEDDED;
+		extents[i].block = i;
+	}
+	map->extents = extents;
+	map->nextents = 2;
+
+	for (int i = 0; i < 160; i++) {
+		embedded[i] = 0x80 | i;
+	}
+	map->embedded = embedded;
+	map->embedded_len = 160;
+}
+
+/* Read plan into a buffer of its size, filled with 0xff beforehand */
+static uint8_t *
+read_plan(libzdb_reader_t *reader, const libzdb_plan_t *plan)
+{
+	const size_t size = plan->buf_end - plan->buf_start;
+	uint8_t *buf = malloc(size);
+
+	memset(buf, 0xff, size);
+	CHECK(libzdb_reader_read(reader, plan, buf, NULL) == 0);
+	return (buf);
+}
+
+/*
+ * Embedded payloads are copied from the map to their place in the buffer,
+ * without opening any device, and holes are left alone
+ */
+static void
+test_embedded(void)
+{
+	libzdb_block_t blocks[2];
+	libzdb_extent_t extents[2];
+	uint8_t embedded[160];
+	libzdb_map_t map;
+	libzdb_plan_t *plan;
+	libzdb_reader_t *reader;
+	uint8_t *buf;
+
+	make_embedded(&map, blocks, extents, embedded);
+	CHECK(libzdb_reader_open(&map, 0, 0, &reader) == 0);
+
+	CHECK(libzdb_plan_build(&map, LIBZDB_COPY_FIRST, NULL, &plan) == 0);
+	CHECK(plan->ndevs == 0 && plan->nembedded == 2);
+	buf = read_plan(reader, plan);
+	CHECK(memcmp(buf, embedded, 100) == 0);
+	CHECK(buf[100] == 0xff && buf[131071] == 0xff);
+	CHECK(memcmp(buf + 131072, embedded + 100, 60) == 0);
+	free(buf);
+	libzdb_plan_free(plan);
+
+	/* a plan of the second block only copies it to the buffer start */
+	map.extents = &extents[1];
+	map.nextents = 1;
+	CHECK(libzdb_plan_build(&map, LIBZDB_COPY_FIRST, NULL, &plan) == 0);
+	CHECK(plan->buf_start == 131072 && plan->nembedded == 1);
+	buf = read_plan(reader, plan);
+	CHECK(memcmp(buf, embedded + 100, 60) == 0);
+	free(buf);
+	libzdb_plan_free(plan);
+
+	libzdb_reader_close(reader);
+}
+
+int
+main(void)
+{
+	/* the reader runs its reads on libzpool task queues */
+	kernel_init(FREAD);
+	test_embedded();
+	kernel_fini();
+
+	return (test_report());
+}
@@ -0,0 +1,197 @@
+#include "libzdb.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the entries found on one device, sorted by dev_offset */
+typedef struct rmap_dev {
+	char *name;
+	libzdb_rmap_entry_t *entries;
+	/* max_end[i] is the highest end offset among entries[0..i] */
+	uint64_t *max_end;
+	size_t count;
+	size_t cap;
+} rmap_dev_t;
+
+struct libzdb_rmap {
+	rmap_dev_t *devs;
+	size_t ndevs;
+};
+
+static void
+rmap_push(rmap_dev_t *dev, const libzdb_map_t *map, const libzdb_extent_t *ext)
+{
+	if (dev->count == dev->cap) {
+		dev->cap = dev->cap ? dev->cap * 2 : 64;
+		dev->entries = realloc(
+		    dev->entries, dev->cap * sizeof(libzdb_rmap_entry_t));
+	}
+
+	libzdb_rmap_entry_t *entry = &dev->entries[dev->count++];
+	entry->dev_offset = ext->dev_offset;
+	entry->length = ext->length;
+	entry->object = map->object;
+	entry->file_offset = ext->file_offset;
+	/* compressed data is located by the block it decompresses to */
+	if (ext->flags & LIBZDB_EXTENT_COMPRESSED) {
+		entry->file_offset = map->blocks[ext->block].file_offset;
+	}
+}
+
+static int
+rmap_entry_cmp(const void *a, const void *b)
+{
+	const libzdb_rmap_entry_t *x = a;
+	const libzdb_rmap_entry_t *y = b;
+
+	if (x->dev_offset != y->dev_offset) {
+		return (x->dev_offset < y->dev_offset ? -1 : 1);
+	}
+	if (x->object != y->object) {
+		return (x->object < y->object ? -1 : 1);
+	}
+	if (x->file_offset != y->file_offset) {
+		return (x->file_offset < y->file_offset ? -1 : 1);
+	}
+	return (0);
+}
+
+/* Sort the entries of a device and index them for libzdb_rmap_query() */
+static void
+rmap_index(rmap_dev_t *dev)
+{
+	uint64_t max_end = 0;
+
+	qsort(dev->entries, dev->count, sizeof(libzdb_rmap_entry_t),
+	    rmap_entry_cmp);
+
+	/*
+	 * Entries of different files only overlap when blocks are shared,
+	 * e.g. by dedup. The running maximum of their end offsets keeps a
+	 * binary search correct in that case.
+	 */
+	dev->max_end = malloc(dev->count * sizeof(uint64_t));
+	for (size_t i = 0; i < dev->count; i++) {
+		const libzdb_rmap_entry_t *entry = &dev->entries[i];
+		if (entry->dev_offset + entry->length > max_end) {
+			max_end = entry->dev_offset + entry->length;
+		}
+		dev->max_end[i] = max_end;
+	}
+}
+
+int
+libzdb_rmap_build(
+    libzdb_session_t *session, const char *dataset, libzdb_rmap_t **rmapp)
+{
+	libzdb_rmap_t *rmap = calloc(1, sizeof(libzdb_rmap_t));
+	uint64_t object = 0;
+	int err;
+
+	while ((err = libzdb_next_file(session, dataset, &object)) == 0) {
+		libzdb_map_t *map;
+
+		/* a file that cannot be mapped is reported and skipped */
+		if (libzdb_map_object(session, dataset, object, &map) != 0) {
+			continue;
+		}
+
+		/* every map of a dataset shares the device table of its pool */
+		if (rmap->devs == NULL) {
+			rmap->ndevs = map->ndevs;
+			rmap->devs = calloc(rmap->ndevs, sizeof(rmap_dev_t));
+			for (size_t i = 0; i < rmap->ndevs; i++) {
+				rmap->devs[i].name = strdup(map->devs[i]);
+			}
+		}
+
+		for (size_t i = 0; i < map->nextents; i++) {
+			const libzdb_extent_t *ext = &map->extents[i];
+			/* embedded data is on no device */
+			if (ext->flags & LIBZDB_EXTENT_EMBEDDED) {
+				continue;
+			}
+			rmap_push(&rmap->devs[ext->dev], map, ext);
+		}
+
+		libzdb_map_free(map);
+	}
+
+	if (err != ESRCH) {
+		libzdb_rmap_free(rmap);
+		return (err);
+	}
+
+	for (size_t i = 0; i < rmap->ndevs; i++) {
+		rmap_index(&rmap->devs[i]);
+	}
+
+	*rmapp = rmap;
+	return (0);
+}
+
+size_t
+libzdb_rmap_query(const libzdb_rmap_t *rmap, const char *dev,
+    uint64_t offset, uint64_t length, libzdb_rmap_func_t *func, void *arg)
+{
+	const rmap_dev_t *rdev = NULL;
+	const uint64_t end =
+	    offset + length < offset ? UINT64_MAX : offset + length;
+	size_t found = 0;
+
+	for (size_t i = 0; i < rmap->ndevs; i++) {
+		if (strcmp(rmap->devs[i].name, dev) == 0) {
+			rdev = &rmap->devs[i];
+			break;
+		}
+	}
+
+	if (!rdev) {
+		return (0);
+	}
+
+	/* find the first entry that may end past offset */
+	size_t lo = 0;
+	size_t hi = rdev->count;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (rdev->max_end[mid] <= offset) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	for (size_t i = lo; i < rdev->count; i++) {
+		const libzdb_rmap_entry_t *entry = &rdev->entries[i];
+
+		if (entry->dev_offset >= end) {
+			break;
+		}
+		if (entry->dev_offset + entry->length > offset) {
+			if (func) {
+				func(entry, arg);
+			}
+			found++;
+		}
+	}
+
+	return (found);
+}
+
+void
+libzdb_rmap_free(libzdb_rmap_t *rmap)
+{
+	if (!rmap) {
+		return;
+	}
+
+	for (size_t i = 0; i < rmap->ndevs; i++) {
+		free(rmap->devs[i].name);
+		free(rmap->devs[i].entries);
+		free(rmap->devs[i].max_end);
+	}
+	free(rmap->devs);
+	free(rmap);
+}
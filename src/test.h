@@ -0,0 +1,176 @@
+#ifndef C2_LIBZDB_TEST_H
+#define C2_LIBZDB_TEST_H
+
+#include "libzdb.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Checks and fixtures shared by the unit tests, each of which is a single
+ * program including this header once
+ */
+
+static int failures;
+
+#define CHECK(cond)                                                        \
+	do {                                                               \
+		if (!(cond)) {                                             \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, \
+			    #cond);                                        \
+			failures++;                                        \
+		}                                                          \
+	} while (0)
+
+#define MiB (1ULL << 20)
+
+/* Report the checks that failed, if any; the exit status of a test */
+static inline int
+test_report(void)
+{
+	if (failures) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return (1);
+	}
+	printf("ok\n");
+	return (0);
+}
+
+/*
+ * The devices of the pool of test maps: a 2-way mirror (vdev 0), a single
+ * disk (vdev 1) and a 3-wide raidz1 (vdev 2)
+ */
+#define TEST_NDEVS 6
+#define TEST_RAIDZ_DEV 3
+
+/* An empty map of a file of file_size bytes on the test pool */
+static inline void
+test_map_init(libzdb_map_t *map, uint64_t file_size)
+{
+	static char *devs[TEST_NDEVS] = {"/dev/sda", "/dev/sdb",
+	    "/var/dsk/disk3", "/dev/sdc", "/dev/sdd", "/dev/sde"};
+	static uint32_t dev_vdevs[TEST_NDEVS] = {0, 0, 1, 2, 2, 2};
+
+	memset(map, 0, sizeof(libzdb_map_t));
+	map->pool_guid = 0x1234567890abcdefULL;
+	map->dataset = "mypool/fs";
+	map->object = 2;
+	map->file_size = file_size;
+	map->devs = devs;
+	map->dev_vdevs = dev_vdevs;
+	map->dev_health = 0xfeedfacecafebeefULL;
+	map->ndevs = TEST_NDEVS;
+}
+
+/*
+ * A map of every kind of block and extent, as cached for a whole file:
+ * 4 blocks, 4 extents and 100 bytes of embedded payload
+ */
+static inline void
+test_make_map(libzdb_map_t *map, libzdb_block_t *blocks,
+    libzdb_extent_t *extents, uint8_t *embedded)
+{
+	test_map_init(map, 3 * 131072 + 100);
+	map->txg = 42;
+	memset(map->cksum_salt, 0xa5, sizeof(map->cksum_salt));
+
+	memset(blocks, 0, 4 * sizeof(libzdb_block_t));
+	/* a plain block on a mirror */
+	blocks[0].file_offset = 0;
+	blocks[0].file_data = 131072;
+	blocks[0].physical_file_data = 131072;
+	blocks[0].offset = 0;
+	blocks[0].actual_size = 131072;
+	blocks[0].ndvas = 1;
+	blocks[0].flags = LIBZDB_BLOCK_CHECKSUM;
+	blocks[0].checksum = 7;
+	for (int k = 0; k < 4; k++) {
+		blocks[0].cksum[k] = 0x0101010101010101ULL * (k + 1);
+	}
+	/* a compressed block on a raidz vdev */
+	blocks[1].file_offset = 131072;
+	blocks[1].file_data = 131072;
+	blocks[1].physical_file_data = 16384;
+	blocks[1].vdev = 2;
+	blocks[1].offset = 1ULL << 40;
+	blocks[1].actual_size = 16384;
+	blocks[1].ndvas = 2;
+	blocks[1].compress = 15;
+	/* a hole */
+	blocks[2].file_offset = 2 * 131072;
+	blocks[2].file_data = 131072;
+	/* the embedded tail of the file */
+	blocks[3].file_offset = 3 * 131072;
+	blocks[3].file_data = 512;
+	blocks[3].physical_file_data = 100;
+	blocks[3].actual_size = 100;
+	blocks[3].flags = LIBZDB_BLOCK_EMBEDDED;
+	map->blocks = blocks;
+	map->nblocks = 4;
+
+	memset(extents, 0, 4 * sizeof(libzdb_extent_t));
+	/* the plain block and its copy on the other side of the mirror */
+	extents[0].file_offset = 0;
+	extents[0].dev_offset = 4 << 20;
+	extents[0].length = 131072;
+	extents[0].dev = 0;
+	extents[0].flags = LIBZDB_EXTENT_CHECKSUM;
+	extents[1] = extents[0];
+	extents[1].dev = 1;
+	extents[1].child = 1;
+	extents[1].flags |= LIBZDB_EXTENT_COPY;
+	/* a raidz column of the compressed block */
+	extents[2].file_offset = 131072 + 8192;
+	extents[2].dev_offset = 1ULL << 40;
+	extents[2].length = 8192;
+	extents[2].dev = TEST_RAIDZ_DEV + 2;
+	extents[2].flags = LIBZDB_EXTENT_RAIDZ | LIBZDB_EXTENT_COMPRESSED;
+	extents[2].block = 1;
+	extents[2].child = 2;
+	extents[2].col = 2;
+	/* the payload of the embedded block */
+	extents[3].file_offset = 3 * 131072;
+	extents[3].dev_offset = 0;
+	extents[3].length = 100;
+	extents[3].flags = LIBZDB_EXTENT_EMBEDDED;
+	extents[3].block = 3;
+	map->extents = extents;
+	map->nextents = 4;
+
+	for (int i = 0; i < 100; i++) {
+		embedded[i] = i;
+	}
+	map->embedded = embedded;
+	map->embedded_len = 100;
+}
+
+/* One 16 MiB extent of a file on each side of the mirror */
+static inline void
+test_make_mirror(
+    libzdb_map_t *map, libzdb_block_t *block, libzdb_extent_t *extents)
+{
+	test_map_init(map, 16 * MiB);
+
+	/* a block as large as the extent, for the sake of the test */
+	memset(block, 0, sizeof(libzdb_block_t));
+	block->file_data = 16 * MiB;
+	block->physical_file_data = 16 * MiB;
+	block->actual_size = 16 * MiB;
+	block->ndvas = 1;
+	map->blocks = block;
+	map->nblocks = 1;
+
+	memset(extents, 0, 2 * sizeof(libzdb_extent_t));
+	extents[0].file_offset = 0;
+	extents[0].dev_offset = 4 * MiB;
+	extents[0].length = 16 * MiB;
+	extents[0].dev = 0;
+	extents[1] = extents[0];
+	extents[1].dev = 1;
+	extents[1].child = 1;
+	extents[1].flags = LIBZDB_EXTENT_COPY;
+	map->extents = extents;
+	map->nextents = 2;
+}
+
+#endif
@@ -31,13 +31,10 @@
 #include <sys/vdev_impl.h>
 #include <sys/vdev_raidz_impl.h>
 
-#include <stdlib.h>
-
 void
-vdev_raidz_map_alloc(zio_t *zio, uint64_t ashift, uint64_t dcols,
-    uint64_t nparity, char **backing, uint64_t actual_size)
+vdev_raidz_map_init(raidz_map_t *rm, zio_t *zio, uint64_t ashift,
+    uint64_t dcols, uint64_t nparity)
 {
-	raidz_map_t *rm;
 	/* The starting RAIDZ (parent) vdev sector of the block. */
 	uint64_t b = zio->io_offset >> ashift;
 	/* The zio's size in units of the vdev's minimum sector size. */
@@ -47,7 +44,6 @@ vdev_raidz_map_alloc(zio_t *zio, uint64_t ashift, uint64_t dcols,
 	/* The starting byte offset on each child vdev. */
 	uint64_t o = (b / dcols) << ashift;
 	uint64_t q, r, c, bc, col, acols, scols, coff, devidx, asize, tot;
-	uint64_t off = 0;
 
 	/*
 	 * "Quotient": The number of data sectors for this stripe on all but
@@ -83,8 +79,6 @@ vdev_raidz_map_alloc(zio_t *zio, uint64_t ashift, uint64_t dcols,
 
 	ASSERT3U(acols, <=, scols);
 
-	rm = malloc(offsetof(raidz_map_t, rm_col[scols]));
-
 	rm->rm_cols = acols;
 	rm->rm_scols = scols;
 	rm->rm_bigcols = bc;
@@ -158,19 +152,105 @@ vdev_raidz_map_alloc(zio_t *zio, uint64_t ashift, uint64_t dcols,
 		if (rm->rm_skipstart == 0)
 			rm->rm_skipstart = 1;
 	}
+}
+
+/*
+ * n / r->d, and n % r->d in *rem, as a multiply by the reciprocal. The
+ * estimate is off by at most one, which a single branch free step corrects.
+ */
+static inline uint64_t
+recip_div(const raidz_recip_t *r, uint64_t n, uint64_t *rem)
+{
+	uint64_t q = ((unsigned __int128) n * r->m) >> 64;
+	uint64_t rm = n - q * r->d;
+	const uint64_t fix = rm >= r->d;
+
+	*rem = rm - fix * r->d;
+	return (q + fix);
+}
+
+static void
+recip_init(raidz_recip_t *r, uint64_t d)
+{
+	r->d = d;
+	r->m = UINT64_MAX / d;
+}
 
-	for (c = rm->rm_firstdatacol; c < rm->rm_cols; c++) {
-		raidz_col_t *rc = &rm->rm_col[c];
-		rc->rc_offset += VDEV_LABEL_START_SIZE;
+void
+vdev_raidz_geom_init(vdev_raidz_geom_t *geom, uint64_t ashift,
+    uint64_t dcols, uint64_t nparity)
+{
+	geom->ashift = ashift;
+	geom->dcols = dcols;
+	geom->nparity = nparity;
+	recip_init(&geom->by_dcols, dcols);
+	recip_init(&geom->by_ndata, dcols - nparity);
+}
 
-		const uint64_t col_size = MIN(actual_size, rc->rc_size);
+/*
+ * The data columns of vdev_raidz_map_init(), for many blocks at once. Every
+ * block goes through the same fixed number of column steps, so that the
+ * inner loop has no data dependent trip count.
+ */
+size_t
+vdev_raidz_map_batch(const vdev_raidz_geom_t *geom, size_t count,
+    const uint64_t *io_offset, const uint64_t *io_size,
+    const uint64_t *actual_size, uint32_t *ncols, uint32_t *devidx,
+    uint64_t *offset, uint64_t *size)
+{
+	const uint64_t ashift = geom->ashift;
+	const uint64_t dcols = geom->dcols;
+	const uint64_t nparity = geom->nparity;
+	const uint64_t ndata = dcols - nparity;
+	size_t total = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		uint32_t *dv = devidx + i * ndata;
+		uint64_t *off = offset + i * ndata;
+		uint64_t *sz = size + i * ndata;
+		uint64_t f, r;
+
+		/* The starting byte offset on each child vdev. */
+		const uint64_t o =
+		    recip_div(&geom->by_dcols, io_offset[i] >> ashift, &f)
+		    << ashift;
+		/* Quotient and remainder of the data sectors per row. */
+		const uint64_t q =
+		    recip_div(&geom->by_ndata, io_size[i] >> ashift, &r);
+		/*
+		 * Single-parity RAID-Z swaps the parity and the first data
+		 * column every other 1MB, see vdev_raidz_map_init().
+		 */
+		const uint64_t swap =
+		    nparity == 1 && (io_offset[i] & (1ULL << 20));
+		const uint64_t actual = actual_size[i];
+		uint32_t n = 0;
 
-		printf("col=%02ld devidx=%02ld dev=%s offset=%lu size=%lu\n", c,
-		    rc->rc_devidx, (char *) backing[rc->rc_devidx],
-		    rc->rc_offset, col_size);
+		/*
+		 * The first r data columns are the big ones, so the size and
+		 * start of a data column within the block follow from its
+		 * index alone and the loop carries no remainder across
+		 * columns, which lets it vectorize.
+		 */
+		for (uint64_t k = 0; k < ndata; k++) {
+			/* the swapped column takes the place of column 0 */
+			uint64_t col = f + (swap && k == 0 ? 0 : nparity + k);
+			const uint64_t wrap = col >= dcols;
+			const uint64_t csize = (q + (k < r)) << ashift;
+			const uint64_t start = (k * q + MIN(k, r)) << ashift;
+			const uint64_t len =
+			    MIN(csize, actual - MIN(actual, start));
+
+			col -= wrap * dcols;
+			dv[k] = col;
+			off[k] = o + (wrap << ashift);
+			sz[k] = len;
+			n += len != 0;
+		}
 
-		actual_size -= col_size;
+		ncols[i] = n;
+		total += n;
 	}
 
-	free(rm);
+	return (total);
 }
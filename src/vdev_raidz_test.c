@@ -0,0 +1,137 @@
+#include "test.h"
+#include "vdev_raidz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Geometries tried, and blocks laid out in one batch for each */
+#define GEOMETRIES 20000
+#define BATCH 16
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+/* xorshift64*, fixed seed so that failures reproduce */
+static uint64_t
+rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 0x2545f4914f6cdd1dULL);
+}
+
+/* A value in [lo, hi] */
+static uint64_t
+rng_range(uint64_t lo, uint64_t hi)
+{
+	return (lo + rng() % (hi - lo + 1));
+}
+
+/*
+ * Compare the columns of block i of a batch with the data columns of
+ * vdev_raidz_map_init() cut to the actual size of the block. Returns the
+ * number of mismatches.
+ */
+static int
+check_block(const vdev_raidz_geom_t *geom, raidz_map_t *rm, uint64_t io_offset,
+    uint64_t io_size, uint64_t actual_size, uint32_t ncols,
+    const uint32_t *devidx, const uint64_t *offset, const uint64_t *size)
+{
+	zio_t zio = {0};
+	uint64_t remaining = actual_size;
+	uint32_t n = 0;
+	int bad = 0;
+
+	zio.io_offset = io_offset;
+	zio.io_size = io_size;
+	vdev_raidz_map_init(rm, &zio, geom->ashift, geom->dcols, geom->nparity);
+
+	for (uint64_t c = geom->nparity; c < rm->rm_cols && remaining; c++) {
+		const uint64_t k = c - geom->nparity;
+		const uint64_t len = MIN(remaining, rm->rm_col[c].rc_size);
+
+		if (len == 0) {
+			continue;
+		}
+		if (k >= ncols || devidx[k] != rm->rm_col[c].rc_devidx ||
+		    offset[k] != rm->rm_col[c].rc_offset || size[k] != len) {
+			bad++;
+		}
+		remaining -= len;
+		n++;
+	}
+	if (n != ncols || remaining != 0) {
+		bad++;
+	}
+
+	if (bad) {
+		fprintf(stderr,
+		    "mismatch: ashift=%llu dcols=%llu nparity=%llu "
+		    "offset=%llu size=%llu actual=%llu\n",
+		    (unsigned long long) geom->ashift,
+		    (unsigned long long) geom->dcols,
+		    (unsigned long long) geom->nparity,
+		    (unsigned long long) io_offset,
+		    (unsigned long long) io_size,
+		    (unsigned long long) actual_size);
+	}
+	return (bad);
+}
+
+int
+main(void)
+{
+	uint64_t io_offset[BATCH], io_size[BATCH], actual_size[BATCH];
+	uint32_t ncols[BATCH];
+
+	for (int g = 0; g < GEOMETRIES; g++) {
+		/* raidz1 geometries take the 1 MiB parity swap half the time */
+		const uint64_t nparity = rng_range(1, 3);
+		const uint64_t dcols = rng_range(nparity + 1, 24);
+		const uint64_t ashift = rng_range(9, 13);
+		const uint64_t ndata = dcols - nparity;
+		vdev_raidz_geom_t geom;
+
+		vdev_raidz_geom_init(&geom, ashift, dcols, nparity);
+
+		uint32_t *devidx = malloc(BATCH * ndata * sizeof(uint32_t));
+		uint64_t *offset = malloc(BATCH * ndata * sizeof(uint64_t));
+		uint64_t *size = malloc(BATCH * ndata * sizeof(uint64_t));
+		raidz_map_t *rm = malloc(VDEV_RAIDZ_MAP_SIZE(dcols));
+
+		for (int i = 0; i < BATCH; i++) {
+			/* from one sector to 16 MiB, mostly small blocks */
+			const uint64_t sectors = (rng() & 1)
+			    ? rng_range(1, 4 * dcols)
+			    : rng_range(1, (16ULL << 20) >> ashift);
+
+			io_offset[i] = rng_range(0, 1ULL << (40 - ashift))
+			    << ashift;
+			io_size[i] = sectors << ashift;
+			/* whole blocks, or cut at the end of the file */
+			actual_size[i] = (rng() & 1)
+			    ? io_size[i]
+			    : rng_range(1, io_size[i]);
+		}
+
+		size_t total = vdev_raidz_map_batch(&geom, BATCH, io_offset,
+		    io_size, actual_size, ncols, devidx, offset, size);
+		size_t sum = 0;
+
+		for (int i = 0; i < BATCH; i++) {
+			failures += check_block(&geom, rm, io_offset[i],
+			    io_size[i], actual_size[i], ncols[i],
+			    devidx + i * ndata, offset + i * ndata,
+			    size + i * ndata);
+			sum += ncols[i];
+		}
+		CHECK(total == sum);
+
+		free(rm);
+		free(size);
+		free(offset);
+		free(devidx);
+	}
+
+	return (test_report());
+}
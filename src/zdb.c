@@ -0,0 +1,505 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or https://opensource.org/licenses/CDDL-1.0.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright (c) 2022 Triad National Security, LLC as operator of Los Alamos
+ *     National Laboratory. All rights reserved.
+ */
+#include "libzdb.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <unistd.h>
+
+#define SECTOR_SIZE 512
+
+/* Bytes of a file mapped and read at a time by -d */
+#define DIRECT_WINDOW (64ULL << 20)
+
+static void
+usage(const char *cmd)
+{
+	fprintf(stderr,
+	    "Syntax: %s [-c] [-C cachedir] [-d | -f format] [-P policy] "
+	    "[-p window] [-r offset:length] zpool filename\n"
+	    "        %s [-c] [-C cachedir] [-f format] [-P policy] "
+	    "[-p window] [-r offset:length] -b [-0] [-j threads] "
+	    "[listfile]\n"
+	    "        %s [-c] [-C cachedir] [-f format] [-P policy] "
+	    "[-p window] [-r offset:length] [-j threads] -a dataset\n"
+	    "        %s [-C cachedir] [-p window] -R dataset "
+	    "[device lba [count]]\n"
+	    "\n"
+	    "    -a  inventory mode: map every plain file of dataset\n"
+	    "    -b  batch mode: map each \"dataset path\" request read\n"
+	    "        from listfile, or from stdin if listfile is omitted\n"
+	    "        or \"-\"\n"
+	    "    -R  reverse map: list the files of dataset holding the\n"
+	    "        count (default 1) 512-byte sectors of device at lba,\n"
+	    "        or of each \"device lba [count]\" query read from\n"
+	    "        stdin if none is given\n"
+	    "    -0  requests are NUL-delimited instead of one per line\n"
+	    "    -c  coalesce extents contiguous on disk and in the file\n"
+	    "    -C  reuse the maps of unchanged files kept in cachedir\n"
+	    "    -d  read the data of the file straight from its devices\n"
+	    "        and write it to stdout instead of its map\n"
+	    "    -f  output format: text (default), binary, or plan for\n"
+	    "        the reads of each device in offset order; batch\n"
+	    "        status lines go to stderr with binary output\n"
+	    "    -j  map batch requests or inventory files on this many\n"
+	    "        threads (default 1, 0 for one per CPU); output is in\n"
+	    "        completion order\n"
+	    "    -p  indirect block reads kept in flight per tree level\n"
+	    "        (default %d, 0 disables read ahead)\n"
+	    "    -P  copy of mirrored data that plans read from: first,\n"
+	    "        rotor (by file offset) or load (least loaded, the\n"
+	    "        default)\n"
+	    "    -r  only map the blocks overlapping this byte range of\n"
+	    "        each file; a length of 0 extends to the end of file\n",
+	    cmd, cmd, cmd, cmd, LIBZDB_DEFAULT_PREFETCH);
+}
+
+/*
+ * Read [start, end) of the file of map straight from its devices, as
+ * planned with policy, and write it to stdout. Returns 0 on success.
+ */
+static int
+read_window(libzdb_reader_t *reader, const libzdb_map_t *map,
+    libzdb_copy_policy_t policy, uint64_t start, uint64_t end)
+{
+	libzdb_plan_t *plan;
+	int err;
+
+	err = libzdb_plan_build(map, policy, NULL, &plan);
+	if (err) {
+		return (err);
+	}
+
+	/* the output may extend over holes beyond the planned reads */
+	const uint64_t lo = MIN(start, plan->buf_start);
+	const uint64_t hi = MAX(end, plan->buf_end);
+	uint8_t *buf = calloc(MAX(hi - lo, 1), 1);
+
+	err = libzdb_reader_read(
+	    reader, plan, buf + (plan->buf_start - lo), NULL);
+	if (err == 0 &&
+	    fwrite(buf + (start - lo), 1, end - start, stdout) !=
+		end - start) {
+		err = errno;
+	}
+
+	free(buf);
+	libzdb_plan_free(plan);
+	return (err);
+}
+
+/*
+ * Read the file at path straight from its devices, as planned with policy,
+ * and write its bytes from offset, up to length of them if not 0, to
+ * stdout. The file is mapped, read and written DIRECT_WINDOW bytes at a
+ * time, so that memory use does not grow with the size of the file.
+ * Returns 0 on success.
+ */
+static int
+read_direct(libzdb_session_t *session, const char *dataset, const char *path,
+    libzdb_copy_policy_t policy, uint64_t offset, uint64_t length)
+{
+	libzdb_reader_t *reader = NULL;
+	uint64_t pos = offset;
+	int err;
+
+	for (;;) {
+		libzdb_map_t *map;
+
+		err = libzdb_map_range(
+		    session, dataset, path, pos, DIRECT_WINDOW, &map);
+		if (err) {
+			break;
+		}
+
+		const uint64_t end = length
+		    ? MIN(offset + length, map->file_size)
+		    : map->file_size;
+		const uint64_t start = MIN(pos, end);
+		const uint64_t wend = MIN(start + DIRECT_WINDOW, end);
+
+		/* every map of the file is on the same devices */
+		if (!reader) {
+			err = libzdb_reader_open(map, 0, 0, &reader);
+			if (err) {
+				fprintf(stderr,
+				    "cannot open a direct reader: %s\n",
+				    strerror(err));
+				libzdb_map_free(map);
+				break;
+			}
+		}
+
+		err = read_window(reader, map, policy, start, wend);
+		libzdb_map_free(map);
+		if (err || wend == end) {
+			break;
+		}
+		pos = wend;
+	}
+
+	libzdb_reader_close(reader);
+	return (err);
+}
+
+/* arg is the stream that status lines are written to */
+static void
+print_status(libzdb_request_t *req, void *arg)
+{
+	FILE *out = arg;
+
+	if (req->path) {
+		fprintf(out, "status=%d (%s) dataset=%s path=%s\n",
+		    req->status, strerror(req->status), req->dataset,
+		    req->path);
+	} else {
+		fprintf(out, "status=%d (%s) dataset=%s object=%lu\n",
+		    req->status, strerror(req->status), req->dataset,
+		    req->object);
+	}
+	fflush(out);
+}
+
+/*
+ * Map every request read from fp through a single session on nthreads
+ * workers. A request is a dataset name and a path separated by the first
+ * space or tab. Each request is followed by a status line so that a failure
+ * does not abort the batch. Returns the number of requests that failed.
+ */
+static size_t
+run_batch(libzdb_session_t *session, FILE *fp, int delim, int nthreads,
+    libzdb_format_t format, uint64_t offset, uint64_t length)
+{
+	FILE *status = format == LIBZDB_FORMAT_BINARY ? stderr : stdout;
+	libzdb_request_t *reqs = NULL;
+	size_t count = 0;
+	size_t cap = 0;
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t len;
+	size_t failed = 0;
+
+	while ((len = getdelim(&line, &linecap, delim, fp)) != -1) {
+		if (len > 0 && line[len - 1] == delim) {
+			line[--len] = '\0';
+		}
+		if (len > 0 && line[len - 1] == '\r') {
+			line[--len] = '\0';
+		}
+		if (len == 0) {
+			continue;
+		}
+
+		char *dataset = line;
+		char *path = dataset + strcspn(dataset, " \t");
+		if (*path != '\0') {
+			*path++ = '\0';
+			path += strspn(path, " \t");
+		}
+
+		if (*path == '\0') {
+			libzdb_request_t bad = {dataset, path, 0, 0, EINVAL, 0};
+			fprintf(stderr, "malformed request '%s'\n", dataset);
+			print_status(&bad, status);
+			failed++;
+			continue;
+		}
+
+		if (count == cap) {
+			cap = cap ? cap * 2 : 64;
+			reqs = realloc(reqs, cap * sizeof(libzdb_request_t));
+		}
+		reqs[count].dataset = strdup(dataset);
+		reqs[count].path = strdup(path);
+		reqs[count].offset = offset;
+		reqs[count].length = length;
+		reqs[count].status = 0;
+		count++;
+	}
+
+	free(line);
+
+	failed += libzdb_map_files(session, reqs, count, nthreads, stdout,
+	    format, print_status, status);
+
+	for (size_t i = 0; i < count; i++) {
+		free((char *) reqs[i].dataset);
+		free((char *) reqs[i].path);
+	}
+	free(reqs);
+
+	return (failed);
+}
+
+/* arg is the device that was queried */
+static void
+print_rmap_entry(const libzdb_rmap_entry_t *entry, void *arg)
+{
+	printf("dev=%s offset=%lu size=%lu object=%lu file_offset=%lu\n",
+	    (const char *) arg, entry->dev_offset, entry->length,
+	    entry->object, entry->file_offset);
+}
+
+/*
+ * Answer one reverse map query for count sectors of dev starting at lba.
+ * Returns 0 if the query was well formed.
+ */
+static int
+rmap_query(const libzdb_rmap_t *rmap, const char *dev, const char *lba,
+    const char *count)
+{
+	char *end;
+	const uint64_t sector = strtoull(lba, &end, 0);
+	if (*lba == '\0' || *end != '\0') {
+		return (EINVAL);
+	}
+
+	uint64_t nsectors = 1;
+	if (count) {
+		nsectors = strtoull(count, &end, 0);
+		if (*count == '\0' || *end != '\0') {
+			return (EINVAL);
+		}
+	}
+
+	size_t found = libzdb_rmap_query(rmap, dev, sector * SECTOR_SIZE,
+	    nsectors * SECTOR_SIZE, print_rmap_entry, (void *) dev);
+	if (found == 0) {
+		printf("dev=%s lba=%lu count=%lu: no file data\n", dev, sector,
+		    nsectors);
+	}
+
+	return (0);
+}
+
+/*
+ * Build the reverse map of dataset and answer the query given by args, or
+ * each "device lba [count]" query read from stdin, one per line. Returns 0
+ * on success.
+ */
+static int
+run_rmap(libzdb_session_t *session, const char *dataset, int argc,
+    char *argv[])
+{
+	libzdb_rmap_t *rmap;
+	int err = libzdb_rmap_build(session, dataset, &rmap);
+	if (err) {
+		fprintf(stderr, "cannot build the reverse map of '%s': %s\n",
+		    dataset, strerror(err));
+		return (err);
+	}
+
+	if (argc > 0) {
+		err = rmap_query(
+		    rmap, argv[0], argv[1], argc > 2 ? argv[2] : NULL);
+		if (err) {
+			fprintf(stderr, "malformed query\n");
+		}
+	} else {
+		char *line = NULL;
+		size_t linecap = 0;
+
+		while (getline(&line, &linecap, stdin) != -1) {
+			char *fields[4];
+			size_t n = 0;
+			char *save;
+
+			char *tok = strtok_r(line, " \t\r\n", &save);
+			while (tok && n < 4) {
+				fields[n++] = tok;
+				tok = strtok_r(NULL, " \t\r\n", &save);
+			}
+
+			if (n == 0) {
+				continue;
+			}
+			if (n < 2 || n > 3 ||
+			    rmap_query(rmap, fields[0], fields[1],
+				n > 2 ? fields[2] : NULL) != 0) {
+				fprintf(stderr, "malformed query '%s'\n",
+				    fields[0]);
+				err = EINVAL;
+			}
+			fflush(stdout);
+		}
+
+		free(line);
+	}
+
+	libzdb_rmap_free(rmap);
+
+	return (err);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *cmd = argv[0];
+	const char *rdataset = NULL;
+	const char *adataset = NULL;
+	const char *cachedir = NULL;
+	int batch = 0;
+	int delim = '\n';
+	unsigned long prefetch = LIBZDB_DEFAULT_PREFETCH;
+	int nthreads = 1;
+	int coalesce = 0;
+	int direct = 0;
+	uint64_t offset = 0;
+	uint64_t length = 0;
+	char *end;
+	libzdb_format_t format = LIBZDB_FORMAT_TEXT;
+	libzdb_copy_policy_t policy = LIBZDB_COPY_LEAST_LOADED;
+	int c;
+
+	while ((c = getopt(argc, argv, "a:b0cC:df:hj:p:P:r:R:")) != -1) {
+		switch (c) {
+		case 'a':
+			adataset = optarg;
+			break;
+		case 'b':
+			batch = 1;
+			break;
+		case '0':
+			delim = '\0';
+			break;
+		case 'c':
+			coalesce = 1;
+			break;
+		case 'C':
+			cachedir = optarg;
+			break;
+		case 'd':
+			direct = 1;
+			break;
+		case 'f':
+			if (strcmp(optarg, "text") == 0) {
+				format = LIBZDB_FORMAT_TEXT;
+			} else if (strcmp(optarg, "binary") == 0) {
+				format = LIBZDB_FORMAT_BINARY;
+			} else if (strcmp(optarg, "plan") == 0) {
+				format = LIBZDB_FORMAT_PLAN;
+			} else {
+				usage(cmd);
+				return (1);
+			}
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'p':
+			prefetch = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			if (strcmp(optarg, "first") == 0) {
+				policy = LIBZDB_COPY_FIRST;
+			} else if (strcmp(optarg, "rotor") == 0) {
+				policy = LIBZDB_COPY_ROTOR;
+			} else if (strcmp(optarg, "load") == 0) {
+				policy = LIBZDB_COPY_LEAST_LOADED;
+			} else {
+				usage(cmd);
+				return (1);
+			}
+			break;
+		case 'r':
+			offset = strtoull(optarg, &end, 0);
+			if (*end != ':') {
+				usage(cmd);
+				return (1);
+			}
+			length = strtoull(end + 1, NULL, 0);
+			break;
+		case 'R':
+			rdataset = optarg;
+			break;
+		default:
+			usage(cmd);
+			return (1);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if ((direct && (adataset || rdataset || batch)) ||
+	    (adataset ? rdataset || batch || argc > 0
+		: rdataset ? batch || argc == 1 || argc > 3
+			   : (batch && argc > 1) || (!batch && argc < 2))) {
+		usage(cmd);
+		return (1);
+	}
+
+	FILE *fp = stdin;
+	if (batch && argc == 1 && strcmp(argv[0], "-") != 0) {
+		if ((fp = fopen(argv[0], "r")) == NULL) {
+			fprintf(stderr, "cannot open '%s': %s\n", argv[0],
+			    strerror(errno));
+			return (1);
+		}
+	}
+
+	libzdb_session_t *session = libzdb_open(NULL);
+	if (!session) {
+		return (1);
+	}
+
+	libzdb_set_prefetch(session, prefetch);
+	libzdb_set_coalesce(session, coalesce);
+	libzdb_set_cache(session, cachedir);
+	libzdb_set_copy_policy(session, policy);
+
+	int err;
+	if (rdataset) {
+		err = run_rmap(session, rdataset, argc, argv);
+	} else if (adataset) {
+		FILE *status = format == LIBZDB_FORMAT_BINARY ? stderr : stdout;
+		err = libzdb_map_dataset(session, adataset, offset, length,
+			  nthreads, stdout, format, print_status, status) != 0;
+	} else if (batch) {
+		err = run_batch(session, fp, delim, nthreads, format, offset,
+			  length) != 0;
+		if (fp != stdin) {
+			fclose(fp);
+		}
+	} else if (direct) {
+		err = read_direct(
+		    session, argv[0], argv[1], policy, offset, length);
+	} else {
+		libzdb_map_t *map;
+		err = libzdb_map_range(
+		    session, argv[0], argv[1], offset, length, &map);
+		if (err == 0) {
+			err = libzdb_map_write(map, stdout, format);
+			libzdb_map_free(map);
+		}
+	}
+
+	libzdb_close(session);
+
+	return (err ? 1 : 0);
+}